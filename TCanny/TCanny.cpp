@@ -22,18 +22,24 @@
 #include <cmath>
 #include <cstddef>
 
+#include <new>
 #include <string>
+#include <unordered_map>
 
 #include "TCanny.h"
 
 using namespace std::literals;
 
+// The scratch pool of every core, shared by all instances on it. A pool goes away with the last instance that uses it.
+static std::mutex sharedScratchMutex;
+static std::unordered_map<VSCore*, std::weak_ptr<TCannyScratchPool>> sharedScratch;
+
 #if defined(TCANNY_X86) || defined(TCANNY_ARM)
-template<typename pixel_t> extern void filter_sse2(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept;
+template<typename pixel_t, typename out_t> extern void filter_sse2(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
 #endif
 #ifdef TCANNY_X86
-template<typename pixel_t> extern void filter_avx2(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept;
-template<typename pixel_t> extern void filter_avx512(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept;
+template<typename pixel_t, typename out_t> extern void filter_avx2(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
+template<typename pixel_t, typename out_t> extern void filter_avx512(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
 #endif
 
 static auto gaussianWeights(const float sigma, int& radius) noexcept {
@@ -55,11 +61,10 @@ static auto gaussianWeights(const float sigma, int& radius) noexcept {
 }
 
 template<typename pixel_t>
-static void gaussianBlur(const pixel_t* _srcp, float* VS_RESTRICT temp, float* VS_RESTRICT dstp, const int width, const int height,
+static void gaussianBlur(const pixel_t* _srcp, const pixel_t** VS_RESTRICT srcp, float* VS_RESTRICT temp, float* VS_RESTRICT dstp, const int width, const int height,
                          const ptrdiff_t srcStride, const ptrdiff_t dstStride, const int radiusH, const int radiusV,
                          const float* weightsH, const float* weightsV) noexcept {
     auto diameter{ radiusV * 2 + 1 };
-    auto srcp{ std::make_unique<const pixel_t* []>(diameter) };
 
     srcp[radiusV] = _srcp;
     for (auto i{ 1 }; i <= radiusV; i++)
@@ -72,7 +77,7 @@ static void gaussianBlur(const pixel_t* _srcp, float* VS_RESTRICT temp, float* V
             auto sum{ 0.0f };
 
             for (auto v{ 0 }; v < diameter; v++)
-                sum += srcp[v][x] * weightsV[v];
+                sum += toFloat(srcp[v][x]) * weightsV[v];
 
             temp[x] = sum;
         }
@@ -105,7 +110,7 @@ static void gaussianBlurH(const pixel_t* srcp, float* VS_RESTRICT temp, float* V
 
     for (auto y{ 0 }; y < height; y++) {
         for (auto x{ 0 }; x < width; x++)
-            temp[x] = srcp[x];
+            temp[x] = toFloat(srcp[x]);
 
         for (auto i{ 1 }; i <= radius; i++) {
             temp[-i] = temp[i];
@@ -127,10 +132,9 @@ static void gaussianBlurH(const pixel_t* srcp, float* VS_RESTRICT temp, float* V
 }
 
 template<typename pixel_t>
-static void gaussianBlurV(const pixel_t* _srcp, float* VS_RESTRICT dstp, const int width, const int height,
+static void gaussianBlurV(const pixel_t* _srcp, const pixel_t** VS_RESTRICT srcp, float* VS_RESTRICT dstp, const int width, const int height,
                           const ptrdiff_t srcStride, const ptrdiff_t dstStride, const int radius, const float* weights) noexcept {
     auto diameter{ radius * 2 + 1 };
-    auto srcp{ std::make_unique<const pixel_t* []>(diameter) };
 
     srcp[radius] = _srcp;
     for (auto i{ 1 }; i <= radius; i++)
@@ -141,7 +145,7 @@ static void gaussianBlurV(const pixel_t* _srcp, float* VS_RESTRICT dstp, const i
             auto sum{ 0.0f };
 
             for (auto v{ 0 }; v < diameter; v++)
-                sum += srcp[v][x] * weights[v];
+                sum += toFloat(srcp[v][x]) * weights[v];
 
             dstp[x] = sum;
         }
@@ -158,21 +162,58 @@ static void copyPlane(const pixel_t* srcp, float* VS_RESTRICT dstp, const int wi
                       const ptrdiff_t srcStride, const ptrdiff_t dstStride) noexcept {
     for (auto y{ 0 }; y < height; y++) {
         for (auto x{ 0 }; x < width; x++)
-            dstp[x] = srcp[x];
+            dstp[x] = toFloat(srcp[x]);
 
         srcp += srcStride;
         dstp += dstStride;
     }
 }
 
-static void detectEdge(float* VS_RESTRICT blur, float* VS_RESTRICT gradient, int* VS_RESTRICT direction, const int width, const int height,
-                       const ptrdiff_t stride, const ptrdiff_t bgStride, const int mode, const int op, const float scale) noexcept {
+template<typename pixel_t>
+static void blurPlane(const pixel_t* srcp, const pixel_t** rows, float* temp, float* dstp, const int width, const int height, const ptrdiff_t srcStride,
+                      const ptrdiff_t dstStride, const int radiusH, const int radiusV, const float* weightsH, const float* weightsV) noexcept {
+    if (radiusH && radiusV)
+        gaussianBlur(srcp, rows, temp, dstp, width, height, srcStride, dstStride, radiusH, radiusV, weightsH, weightsV);
+    else if (radiusH)
+        gaussianBlurH(srcp, temp, dstp, width, height, srcStride, dstStride, radiusH, weightsH);
+    else if (radiusV)
+        gaussianBlurV(srcp, rows, dstp, width, height, srcStride, dstStride, radiusV, weightsV);
+    else
+        copyPlane(srcp, dstp, width, height, srcStride, dstStride);
+}
+
+template<typename pixel_t, bool clampFP = true>
+static inline pixel_t discretize(const float srcp, const int peak) noexcept {
+    if constexpr (std::is_integral_v<pixel_t>)
+        return static_cast<pixel_t>(std::clamp(static_cast<int>(srcp + 0.5f), 0, peak));
+    else if constexpr (std::is_same_v<pixel_t, half>)
+        return floatToHalf(clampFP ? std::clamp(srcp, 0.0f, 1.0f) : srcp);
+    else if constexpr (clampFP)
+        return std::clamp(srcp, 0.0f, 1.0f);
+    else
+        return srcp;
+}
+
+template<typename pixel_t>
+static void detectEdge(float* VS_RESTRICT blur, float* VS_RESTRICT gradient, int* VS_RESTRICT direction, float* VS_RESTRICT activity,
+                       float* VS_RESTRICT contrast, TCannyStats* VS_RESTRICT stats, pixel_t* VS_RESTRICT dstp, const int width, const int height,
+                       const ptrdiff_t stride, const ptrdiff_t bgStride, const ptrdiff_t dstStride, const int tilesX, const int mode, const int op,
+                       const float scale, const float outScale, const float offset, const float gamma, const int peak) noexcept {
     auto cur{ blur };
     auto next{ blur + bgStride };
     auto next2{ blur + bgStride * 2 };
     auto prev{ next };
     auto prev2{ next2 };
 
+    double gradSum{}, orientation[4]{};
+    auto gradMax{ 0.0f };
+    const auto rampPeak{ std::is_integral_v<pixel_t> ? static_cast<float>(peak) : 1.0f };
+
+    if (mode == 0)
+        std::fill_n(activity, tilesX * ((height + activityTileSize - 1) / activityTileSize), 0.0f);
+    if (contrast)
+        std::fill_n(contrast, tilesX * ((height + activityTileSize - 1) / activityTileSize), 0.0f);
+
     cur[-1] = cur[1];
     cur[width] = cur[width - 2];
     if (op == FDOG) {
@@ -194,7 +235,7 @@ static void detectEdge(float* VS_RESTRICT blur, float* VS_RESTRICT gradient, int
         }
 
         for (auto x{ 0 }; x < width; x++) {
-            float gx{}, gy{};
+            float gx{}, gy{}, magnitude{};
 
             if (op != FDOG) {
                 auto c1{ prev[x - 1] };
@@ -237,7 +278,7 @@ static void detectEdge(float* VS_RESTRICT blur, float* VS_RESTRICT gradient, int
                     auto g7{ -3.0f * c1 - 3.0f * c2 + 5.0f * c3 - 3.0f * c4 + 5.0f * c6 - 3.0f * c7 - 3.0f * c8 + 5.0f * c9 };
                     auto g8{ -3.0f * c1 + 5.0f * c2 + 5.0f * c3 - 3.0f * c4 + 5.0f * c6 - 3.0f * c7 - 3.0f * c8 - 3.0f * c9 };
                     auto g{ std::max({ std::abs(g1), std::abs(g2), std::abs(g3), std::abs(g4), std::abs(g5), std::abs(g6), std::abs(g7), std::abs(g8) }) };
-                    gradient[x] = g * scale;
+                    magnitude = g * scale;
                     break;
                 }
             } else {
@@ -275,16 +316,40 @@ static void detectEdge(float* VS_RESTRICT blur, float* VS_RESTRICT gradient, int
             if (op != KIRSCH) {
                 gx *= scale;
                 gy *= scale;
-                gradient[x] = std::sqrt(gx * gx + gy * gy);
+                magnitude = std::sqrt(gx * gx + gy * gy);
             }
 
-            if (mode == 0) {
+            if (stats) {
+                gradSum += magnitude;
+                gradMax = std::max(gradMax, magnitude);
+            }
+
+            if (mode == 1 || mode == 3) {
+                auto value{ magnitude * outScale + offset };
+                if (mode == 3 && gamma != 1.0f)
+                    value = std::pow(std::clamp(value / rampPeak, 0.0f, 1.0f), gamma) * rampPeak;
+                dstp[x] = discretize<pixel_t>(value, peak);
+            } else {
+                gradient[x] = magnitude;
+
+                if (mode == 0) {
+                    const auto tile{ (y / activityTileSize) * tilesX + x / activityTileSize };
+                    activity[tile] = std::max(activity[tile], magnitude);
+                    if (contrast)
+                        contrast[tile] += magnitude;
+                }
+            }
+
+            if (mode == 0 || mode == 2) {
                 auto dr{ std::atan2(gy, gx) };
                 if (dr < 0.0f)
                     dr += M_PIF;
 
                 auto bin{ static_cast<int>(dr * 4.0f * M_1_PIF + 0.5f) };
                 direction[x] = (bin >= 4) ? 0 : bin;
+
+                if (stats)
+                    orientation[direction[x]] += magnitude;
             }
         }
 
@@ -299,12 +364,29 @@ static void detectEdge(float* VS_RESTRICT blur, float* VS_RESTRICT gradient, int
         }
         gradient += bgStride;
         direction += stride;
+        dstp += dstStride;
+    }
+
+    if (stats) {
+        stats->gradSum = gradSum;
+        stats->gradMax = gradMax;
+        std::copy_n(orientation, 4, stats->orientation);
     }
 }
 
-static void nonMaximumSuppression(const int* direction, float* VS_RESTRICT gradient, float* VS_RESTRICT blur, const int width, const int height,
-                                  const ptrdiff_t stride, const ptrdiff_t bgStride, const int radiusAlign) noexcept {
+// Thins the gradient to its ridges in blur. The positions of the ridge pixels >= t_h, or of all of them when the histogram is filled, are
+// appended to seeds as they are found. The SIMD versions take them from the bits of the comparison mask one at a time instead of packing them,
+// since there are few of them per vector.
+template<bool thresholded = true>
+static void nonMaximumSuppression(const int* direction, float* VS_RESTRICT gradient, float* VS_RESTRICT blur, const float* activity,
+                                  std::vector<uint32_t>& seeds, int* VS_RESTRICT histogram, const float* contrast, float* VS_RESTRICT scaleRow,
+                                  const int width, const int height, const ptrdiff_t stride, const ptrdiff_t bgStride, const int tilesX, const int radiusAlign,
+                                  const float t_h, const float t_l, const float binScale) {
     const ptrdiff_t offsets[]{ 1, -bgStride + 1, -bgStride, -bgStride - 1 };
+    const auto suppressed{ thresholded ? fltLowest : 0.0f };
+    seeds.clear();
+    if (histogram)
+        std::fill_n(histogram, histogramBins, 0);
 
     gradient[-1] = gradient[1];
     gradient[-1 + bgStride * (height - 1)] = gradient[1 + bgStride * (height - 1)];
@@ -314,9 +396,33 @@ static void nonMaximumSuppression(const int* direction, float* VS_RESTRICT gradi
     std::copy_n(gradient - radiusAlign + bgStride * (height - 2), width + radiusAlign * 2, gradient - radiusAlign + bgStride * height);
 
     for (auto y{ 0 }; y < height; y++) {
+        if (scaleRow)
+            interpolateScales(contrast, scaleRow, y, width, height, tilesX);
+
         for (auto x{ 0 }; x < width; x++) {
+            if constexpr (thresholded) {
+                if (activity[(y / activityTileSize) * tilesX + x / activityTileSize] < t_l) {
+                    blur[x] = fltLowest;
+                    continue;
+                }
+            }
+
             auto offset{ offsets[direction[x]] };
-            blur[x] = (gradient[x] >= std::max(gradient[x + offset], gradient[x - offset])) ? gradient[x] : fltLowest;
+            if (gradient[x] >= std::max(gradient[x + offset], gradient[x - offset]))
+                blur[x] = scaleRow ? gradient[x] * scaleRow[x] : gradient[x];
+            else
+                blur[x] = suppressed;
+
+            if constexpr (thresholded) {
+                if (histogram) {
+                    if (blur[x] > 0.0f) {
+                        seeds.push_back(static_cast<uint32_t>(bgStride * y + x));
+                        histogram[std::min(static_cast<int>(blur[x] * binScale), histogramBins - 1)]++;
+                    }
+                } else if (blur[x] >= t_h) {
+                    seeds.push_back(static_cast<uint32_t>(bgStride * y + x));
+                }
+            }
         }
 
         direction += stride;
@@ -325,84 +431,177 @@ static void nonMaximumSuppression(const int* direction, float* VS_RESTRICT gradi
     }
 }
 
-template<typename pixel_t>
-static void binarizeCE(const float* srcp, pixel_t* VS_RESTRICT dstp, const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
-                       const int peak) noexcept {
+template<typename pixel_t, bool clampFP = true>
+static void discretizeGM(const float* srcp, pixel_t* VS_RESTRICT dstp, const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                         const int peak, const float outScale) noexcept {
     for (auto y{ 0 }; y < height; y++) {
-        for (auto x{ 0 }; x < width; x++) {
-            if constexpr (std::is_integral_v<pixel_t>)
-                dstp[x] = (srcp[x] == fltMax) ? static_cast<pixel_t>(peak) : 0;
-            else
-                dstp[x] = (srcp[x] == fltMax) ? 1.0f : 0.0f;
-        }
+        for (auto x{ 0 }; x < width; x++)
+            dstp[x] = discretize<pixel_t, clampFP>(srcp[x] * outScale, peak);
 
         srcp += srcStride;
         dstp += dstStride;
     }
 }
 
-template<typename pixel_t, bool clampFP = true>
-static void discretizeGM(const float* srcp, pixel_t* VS_RESTRICT dstp, const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
-                         const int peak) noexcept {
+// The kernels of this file for filterPlanes.
+struct KernelsC final {
+    template<typename... Args>
+    static void blurPlane(Args&&... args) noexcept { ::blurPlane(std::forward<Args>(args)...); }
+
+    template<typename... Args>
+    static void detectEdge(Args&&... args) noexcept { ::detectEdge(std::forward<Args>(args)...); }
+
+    template<bool thresholded = true, typename... Args>
+    static void nonMaximumSuppression(Args&&... args) { ::nonMaximumSuppression<thresholded>(std::forward<Args>(args)...); }
+
+    template<typename pixel_t, bool clampFP = true, typename... Args>
+    static void discretizeGM(Args&&... args) noexcept { ::discretizeGM<pixel_t, clampFP>(std::forward<Args>(args)...); }
+};
+
+template<typename pixel_t, typename out_t>
+static void filter_c(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi) {
+    filterPlanes<KernelsC, pixel_t, out_t>(src, dst, d, scratch, vsapi);
+}
+
+template<typename pixel_t>
+static void convertPlane(const pixel_t* srcp, uint8_t* VS_RESTRICT dstp, const int width, const int height, const ptrdiff_t srcStride,
+                         const ptrdiff_t dstStride, const float offset, const float scale) noexcept {
     for (auto y{ 0 }; y < height; y++) {
-        for (auto x{ 0 }; x < width; x++) {
-            if constexpr (std::is_integral_v<pixel_t>)
-                dstp[x] = static_cast<pixel_t>(std::min(static_cast<int>(srcp[x] + 0.5f), peak));
-            else if constexpr (clampFP)
-                dstp[x] = std::clamp(srcp[x], 0.0f, 1.0f);
-            else
-                dstp[x] = srcp[x];
-        }
+        for (auto x{ 0 }; x < width; x++)
+            dstp[x] = static_cast<uint8_t>(std::clamp(static_cast<int>((toFloat(srcp[x]) + offset) * scale + 0.5f), 0, 255));
 
         srcp += srcStride;
         dstp += dstStride;
     }
 }
 
-template<typename pixel_t>
-static void filter_c(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept {
+// Copies the unprocessed planes into every slot of the stacked output, converting them to 8 bit when outfmt is set.
+static void copyUnprocessedPlanes(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept {
     for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
-        if (d->process[plane]) {
+        if (!d->process[plane]) {
             const auto width{ vsapi->getFrameWidth(src, plane) };
             const auto height{ vsapi->getFrameHeight(src, plane) };
-            const auto stride{ vsapi->getStride(src, plane) / d->vi->format.bytesPerSample };
-            const auto bgStride{ stride + d->radiusAlign * 2 };
-            auto srcp{ reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane)) };
-            auto dstp{ reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, plane)) };
-
-            const auto threadId{ std::this_thread::get_id() };
-            auto blur{ d->blur.at(threadId).get() + d->radiusAlign };
-            auto gradient{ d->gradient.at(threadId).get() + bgStride + d->radiusAlign };
-            auto direction{ d->direction.at(threadId).get() };
-            auto found{ d->found.at(threadId).get() };
-
-            if (d->radiusH[plane] && d->radiusV[plane])
-                gaussianBlur(srcp, gradient, blur, width, height, stride, bgStride, d->radiusH[plane], d->radiusV[plane],
-                             d->weightsH[plane].get(), d->weightsV[plane].get());
-            else if (d->radiusH[plane])
-                gaussianBlurH(srcp, gradient, blur, width, height, stride, bgStride, d->radiusH[plane], d->weightsH[plane].get());
-            else if (d->radiusV[plane])
-                gaussianBlurV(srcp, blur, width, height, stride, bgStride, d->radiusV[plane], d->weightsV[plane].get());
-            else
-                copyPlane(srcp, blur, width, height, stride, bgStride);
-
-            if (d->mode != -1) {
-                detectEdge(blur, gradient, direction, width, height, stride, bgStride, d->mode, d->op, d->scale);
-
-                if (d->mode == 0) {
-                    nonMaximumSuppression(direction, gradient, blur, width, height, stride, bgStride, d->radiusAlign);
-                    hysteresis(blur, found, width, height, bgStride, d->t_h, d->t_l);
+            const auto srcStride{ vsapi->getStride(src, plane) };
+            const auto stride{ srcStride / d->vi->format.bytesPerSample };
+            const auto dstStride{ vsapi->getStride(dst, plane) };
+            auto srcp{ vsapi->getReadPtr(src, plane) };
+
+            for (auto k{ 0 }; k < d->outVi.height / d->vi->height; k++) {
+                auto dstp{ vsapi->getWritePtr(dst, plane) + dstStride * height * k };
+
+                if (!d->outfmt) {
+                    vsh::bitblt(dstp, dstStride, srcp, srcStride, width * d->vi->format.bytesPerSample, height);
+                } else if (d->vi->format.sampleType == stInteger) {
+                    convertPlane(reinterpret_cast<const uint16_t*>(srcp), dstp, width, height, stride, dstStride, 0.0f, d->outScale);
+                } else {
+                    auto offset{ (plane && d->vi->format.colorFamily == cfYUV) ? 0.5f : 0.0f };
+                    if (d->vi->format.bytesPerSample == 2)
+                        convertPlane(reinterpret_cast<const half*>(srcp), dstp, width, height, stride, dstStride, offset, d->outScale);
+                    else
+                        convertPlane(reinterpret_cast<const float*>(srcp), dstp, width, height, stride, dstStride, offset, d->outScale);
                 }
             }
+        }
+    }
+}
 
-            if (d->mode == 0)
-                binarizeCE(blur, dstp, width, height, bgStride, stride, d->peak);
-            else if (d->mode == 1)
-                discretizeGM(gradient, dstp, width, height, bgStride, stride, d->peak);
+// Merges the results of planes 1 and 2, which the filter leaves in planeOut, into the single plane of dst by taking the maximum. Subsampled
+// planes are upsampled to the resolution of the first plane by nearest neighbor.
+static void combinePlanes(VSFrame* dst, const TCannyData* const VS_RESTRICT d, const TCannyScratch* scratch, const VSAPI* vsapi) noexcept {
+    const auto width{ vsapi->getFrameWidth(dst, 0) };
+    const auto height{ vsapi->getFrameHeight(dst, 0) };
+    const auto stride{ vsapi->getStride(dst, 0) / d->outVi.format.bytesPerSample };
+    auto dstp{ vsapi->getWritePtr(dst, 0) };
+
+    if (!d->process[0])
+        std::fill_n(dstp, vsapi->getStride(dst, 0) * height, 0);
+
+    for (auto plane{ 1 }; plane < d->vi->format.numPlanes; plane++) {
+        if (d->process[plane]) {
+            const auto ssW{ d->vi->format.subSamplingW };
+            const auto ssH{ d->vi->format.subSamplingH };
+            auto srcp{ scratch->planeOut[plane - 1].get() };
+
+            if (d->outVi.format.bytesPerSample == 1)
+                maxPlane(srcp, dstp, width, height, stride, ssW, ssH);
+            else if (d->outVi.format.bytesPerSample == 2)
+                maxPlane(reinterpret_cast<const uint16_t*>(srcp), reinterpret_cast<uint16_t*>(dstp), width, height, stride, ssW, ssH);
             else
-                discretizeGM<pixel_t, false>(blur, dstp, width, height, bgStride, stride, d->peak);
+                maxPlane(reinterpret_cast<const float*>(srcp), reinterpret_cast<float*>(dstp), width, height, stride, ssW, ssH);
+        }
+    }
+}
+
+// Grows a scratch set to everything the filter needs for one frame. dstStride is the stride of the first plane of the output in bytes.
+static void allocateScratch(TCannyScratch& s, const TCannyData* const VS_RESTRICT d, const int stride, const ptrdiff_t dstStride) {
+    auto grow{ [](auto& v, const size_t size) {
+        if (v.size() < size)
+            v.resize(size);
+    } };
+
+    if (!s.blur.reserve(static_cast<size_t>(stride + d->radiusAlign * 2) * d->vi->height, d->alignment))
+        throw "malloc failure (blur)"s;
+
+    if (d->sigmaScales.size() > 1) {
+        if (!s.blur2.reserve(static_cast<size_t>(stride + d->radiusAlign * 2) * d->vi->height, d->alignment))
+            throw "malloc failure (blur2)"s;
+
+        if (d->smode != 1 && !s.scaleOut.reserve(dstStride * d->vi->height, d->alignment))
+            throw "malloc failure (scaleOut)"s;
+    }
+
+    // Only modes 0, 2 and 4 keep the gradient of the whole plane. Otherwise it is just the row that the blur uses as temporary storage.
+    auto gradientHeight{ (d->mode == 0 || d->mode == 2 || d->mode == 4) ? d->vi->height + 2 : 2 };
+    if (!s.gradient.reserve(static_cast<size_t>(stride + d->radiusAlign * 2) * gradientHeight, d->alignment))
+        throw "malloc failure (gradient)"s;
+
+    if ((d->mode == 0 || d->mode == 2 || d->mode == 4) && !s.direction.reserve(static_cast<size_t>(stride) * d->vi->height, d->alignment))
+        throw "malloc failure (direction)"s;
+
+    if (d->mode == 0 || d->mode == 4) {
+        const auto tiles{ static_cast<size_t>((d->vi->width + activityTileSize - 1) / activityTileSize) *
+                          ((d->vi->height + activityTileSize - 1) / activityTileSize) };
+        if (!s.activity.reserve(tiles, d->alignment))
+            throw "malloc failure (activity)"s;
+
+        s.seeds.reserve(d->vi->width * 4);
+        s.spans.reserve(d->vi->width * 4);
+        s.borders.reserve(d->vi->width * 4);
+
+        if (d->tmode == 1 || d->tmode == 2)
+            grow(s.histogram, histogramBins);
+
+        if (d->expand) {
+            grow(s.expandDist, static_cast<size_t>(d->vi->width) * d->vi->height);
+            grow(s.expandEnds, d->vi->width);
+        }
+
+        if (d->thresholdPairs.size() > 1) {
+            s.pairSeeds.reserve(d->vi->width * 4);
+            if (d->hmode == 0 && d->threads == 1)
+                grow(s.suppressed, (stride + d->radiusAlign * 2) * static_cast<size_t>(d->vi->height));
         }
+
+        if (d->tmode == 3 && (!s.contrast.reserve(tiles, d->alignment) || !s.scaleRow.reserve(stride, d->alignment)))
+            throw "malloc failure (contrast)"s;
+
+        if (d->mode == 4 && (!s.parabolas.reserve(d->vi->width, d->alignment) || !s.boundaries.reserve(d->vi->width + 1, d->alignment)))
+            throw "malloc failure (parabolas)"s;
     }
+
+    if (d->combine) {
+        for (auto i{ 0 }; i < 2; i++) {
+            if (!s.planeOut[i].reserve(dstStride * d->outVi.height, d->alignment))
+                throw "malloc failure (planeOut)"s;
+        }
+    }
+
+    auto radiusV{ std::max({ d->radiusV[0], d->radiusV[1], d->radiusV[2] }) };
+    for (const auto& step : d->scaleSteps)
+        radiusV = std::max({ radiusV, step.radiusV[0], step.radiusV[1], step.radiusV[2] });
+
+    if (!s.rows.reserve(radiusV * 2 + 1, d->alignment))
+        throw "malloc failure (rows)"s;
 }
 
 static const VSFrame* VS_CC tcannyGetFrame(int n, int activationReason, void* instanceData, [[maybe_unused]] void** frameData, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
@@ -412,51 +611,81 @@ static const VSFrame* VS_CC tcannyGetFrame(int n, int activationReason, void* in
         vsapi->requestFrameFilter(n, d->node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
         auto src{ vsapi->getFrameFilter(n, d->node, frameCtx) };
-        const VSFrame* fr[]{ d->process[0] ? nullptr : src, d->process[1] ? nullptr : src, d->process[2] ? nullptr : src };
+        auto copy{ (d->outfmt || d->outVi.height != d->vi->height) ? nullptr : src };
+        const VSFrame* fr[]{ d->process[0] ? nullptr : copy, d->process[1] ? nullptr : copy, d->process[2] ? nullptr : copy };
         const int pl[]{ 0, 1, 2 };
-        auto dst{ vsapi->newVideoFrame2(&d->vi->format, d->vi->width, d->vi->height, fr, pl, src, core) };
+        auto dst{ d->combine ? vsapi->newVideoFrame(&d->outVi.format, d->outVi.width, d->outVi.height, src, core)
+                             : vsapi->newVideoFrame2(&d->outVi.format, d->outVi.width, d->outVi.height, fr, pl, src, core) };
 
         try {
-            auto threadId{ std::this_thread::get_id() };
-            auto stride{ vsapi->getStride(src, 0) / d->vi->format.bytesPerSample };
-
-            if (!d->blur.count(threadId)) {
-                auto blur{ vsh::vsh_aligned_malloc<float>((stride + d->radiusAlign * 2) * d->vi->height * sizeof(float), d->alignment) };
-                if (!blur)
-                    throw "malloc failure (blur)"s;
-                d->blur.emplace(threadId, unique_float{ blur, vsh::vsh_aligned_free });
-
-                auto gradient{ vsh::vsh_aligned_malloc<float>((stride + d->radiusAlign * 2) * (d->vi->height + 2) * sizeof(float), d->alignment) };
-                if (!gradient)
-                    throw "malloc failure (gradient)"s;
-                d->gradient.emplace(threadId, unique_float{ gradient, vsh::vsh_aligned_free });
-
-                if (d->mode == 0) {
-                    auto direction{ vsh::vsh_aligned_malloc<int>(stride * d->vi->height * sizeof(int), d->alignment) };
-                    if (!direction)
-                        throw "malloc failure (direction)"s;
-                    d->direction.emplace(threadId, unique_int{ direction, vsh::vsh_aligned_free });
-
-                    auto found{ new (std::nothrow) bool[d->vi->width * d->vi->height] };
-                    if (!found)
-                        throw "malloc failure (found)"s;
-                    d->found.emplace(threadId, found);
-                } else {
-                    d->direction.emplace(threadId, unique_int{ nullptr, vsh::vsh_aligned_free });
-                    d->found.emplace(threadId, nullptr);
+            TCannyScratchPool::Lease scratch{ *d->scratch };
+
+            // The set may come from another instance, so the results of the planes that are not processed have to be cleared.
+            for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
+                if (!d->process[plane]) {
+                    scratch->stats[plane] = {};
+                    scratch->thresholds[plane][0] = scratch->thresholds[plane][1] = 0.0f;
+                    scratch->runs[plane].clear();
+                }
+            }
+
+            d->filter(src, dst, d, scratch.get(), vsapi);
+
+            if (d->combine)
+                combinePlanes(dst, d, scratch.get(), vsapi);
+            else if (d->outfmt || d->outVi.height != d->vi->height)
+                copyUnprocessedPlanes(src, dst, d, vsapi);
+
+            if (d->stats) {
+                auto props{ vsapi->getFramePropertiesRW(dst) };
+
+                for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
+                    const auto& stats{ scratch->stats[plane] };
+                    const auto mode{ plane ? maAppend : maReplace };
+                    const auto numPixels{ static_cast<double>(vsapi->getFrameWidth(src, plane)) * vsapi->getFrameHeight(src, plane) };
+
+                    if (d->mode == 0 || d->mode == 4)
+                        vsapi->mapSetInt(props, "_TCannyEdgeCount", stats.edgeCount, mode);
+
+                    vsapi->mapSetFloat(props, "_TCannyGradMean", stats.gradSum / numPixels * d->statsScale, mode);
+                    vsapi->mapSetFloat(props, "_TCannyGradMax", stats.gradMax * d->statsScale, mode);
+
+                    if (d->mode == 0 || d->mode == 2 || d->mode == 4) {
+                        const auto total{ stats.orientation[0] + stats.orientation[1] + stats.orientation[2] + stats.orientation[3] };
+                        for (auto i{ 0 }; i < 4; i++)
+                            vsapi->mapSetFloat(props, "_TCannyOrientation", total > 0.0 ? stats.orientation[i] / total : 0.0, (plane || i) ? maAppend : maReplace);
+                    }
+                }
+            }
+
+            if (d->tmode == 1 || d->tmode == 2) {
+                auto props{ vsapi->getFramePropertiesRW(dst) };
+
+                for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
+                    const auto mode{ plane ? maAppend : maReplace };
+                    vsapi->mapSetFloat(props, "_TCannyTHigh", scratch->thresholds[plane][0] * d->statsScale, mode);
+                    vsapi->mapSetFloat(props, "_TCannyTLow", scratch->thresholds[plane][1] * d->statsScale, mode);
+                }
+            }
+
+            if (d->runs) {
+                auto props{ vsapi->getFramePropertiesRW(dst) };
+
+                for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
+                    const auto& runs{ scratch->runs[plane] };
+                    vsapi->mapSetData(props, "_TCannyEdgeRuns", runs.empty() ? "" : reinterpret_cast<const char*>(runs.data()), static_cast<int>(runs.size()),
+                                      dtBinary, plane ? maAppend : maReplace);
                 }
             }
-        } catch (const std::string& error) {
-            vsapi->setFilterError(("TCanny: " + error).c_str(), frameCtx);
+
             vsapi->freeFrame(src);
-            vsapi->freeFrame(dst);
-            return nullptr;
+            return dst;
+        } catch (const std::bad_alloc&) {
+            vsapi->setFilterError("TCanny: malloc failure", frameCtx);
         }
 
-        d->filter(src, dst, d, vsapi);
-
         vsapi->freeFrame(src);
-        return dst;
+        vsapi->freeFrame(dst);
     }
 
     return nullptr;
@@ -468,6 +697,32 @@ static void VS_CC tcannyFree(void* instanceData, [[maybe_unused]] VSCore* core,
     delete d;
 }
 
+template<typename pixel_t, typename out_t>
+static auto selectFilter([[maybe_unused]] const int opt) noexcept {
+    auto filter{ filter_c<pixel_t, out_t> };
+
+#if defined(TCANNY_X86) || defined(TCANNY_ARM)
+    const auto iset{ instrset_detect() };
+
+#ifdef TCANNY_X86
+    // The AVX2 and AVX512 paths convert 16 bit float samples with F16C. Without it they are left to the software conversion of SSE2.
+    const auto f16c{ !std::is_same_v<pixel_t, half> || hasF16C() };
+
+    if (f16c && ((opt == 0 && iset >= 10) || opt == 4))
+        filter = filter_avx512<pixel_t, out_t>;
+    else if (f16c && ((opt == 0 && iset >= 8) || opt == 3))
+        filter = filter_avx2<pixel_t, out_t>;
+    else if (opt >= 3)
+        filter = filter_sse2<pixel_t, out_t>;
+    else
+#endif
+    if ((opt == 0 && iset >= 2) || opt == 2)
+        filter = filter_sse2<pixel_t, out_t>;
+#endif
+
+    return filter;
+}
+
 static void VS_CC tcannyCreate(const VSMap* in, VSMap* out, [[maybe_unused]] void* userData, VSCore* core, const VSAPI* vsapi) {
     auto d{ std::make_unique<TCannyData>() };
 
@@ -478,8 +733,8 @@ static void VS_CC tcannyCreate(const VSMap* in, VSMap* out, [[maybe_unused]] voi
 
         if (!vsh::isConstantVideoFormat(d->vi) ||
             (d->vi->format.sampleType == stInteger && d->vi->format.bitsPerSample > 16) ||
-            (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 32))
-            throw "only constant format 8-16 bit integer and 32 bit float input supported"s;
+            (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 16 && d->vi->format.bitsPerSample != 32))
+            throw "only constant format 8-16 bit integer and 16/32 bit float input supported"s;
 
         if (d->vi->height < 3)
             throw "clip's height must be at least 3"s;
@@ -516,13 +771,14 @@ static void VS_CC tcannyCreate(const VSMap* in, VSMap* out, [[maybe_unused]] voi
                 sigmaV[2] = sigmaV[1];
         }
 
-        d->t_h = vsapi->mapGetFloatSaturated(in, "t_h", 0, &err);
-        if (err)
-            d->t_h = 8.0f;
+        const auto numT_h{ vsapi->mapNumElements(in, "t_h") };
+        const auto numT_l{ vsapi->mapNumElements(in, "t_l") };
 
-        d->t_l = vsapi->mapGetFloatSaturated(in, "t_l", 0, &err);
-        if (err)
-            d->t_l = 1.0f;
+        for (auto i{ 0 }; i < std::max({ numT_h, numT_l, 1 }); i++) {
+            auto t_h{ (numT_h > 0) ? vsapi->mapGetFloatSaturated(in, "t_h", std::min(i, numT_h - 1), nullptr) : 8.0f };
+            auto t_l{ (numT_l > 0) ? vsapi->mapGetFloatSaturated(in, "t_l", std::min(i, numT_l - 1), nullptr) : 1.0f };
+            d->thresholdPairs.emplace_back(t_h, t_l);
+        }
 
         d->mode = vsapi->mapGetIntSaturated(in, "mode", 0, &err);
 
@@ -536,6 +792,44 @@ static void VS_CC tcannyCreate(const VSMap* in, VSMap* out, [[maybe_unused]] voi
 
         auto opt{ vsapi->mapGetIntSaturated(in, "opt", 0, &err) };
 
+        d->threads = vsapi->mapGetIntSaturated(in, "threads", 0, &err);
+        if (err)
+            d->threads = 1;
+
+        d->hmode = vsapi->mapGetIntSaturated(in, "hmode", 0, &err);
+
+        d->tmode = vsapi->mapGetIntSaturated(in, "tmode", 0, &err);
+
+        d->tpct = vsapi->mapGetFloatSaturated(in, "tpct", 0, &err);
+        if (err)
+            d->tpct = 70.0f;
+
+        d->expand = vsapi->mapGetIntSaturated(in, "expand", 0, &err);
+
+        d->eshape = vsapi->mapGetIntSaturated(in, "eshape", 0, &err);
+
+        d->outfmt = vsapi->mapGetIntSaturated(in, "outfmt", 0, &err);
+
+        d->runs = !!vsapi->mapGetInt(in, "runs", 0, &err);
+
+        d->stats = !!vsapi->mapGetInt(in, "stats", 0, &err);
+
+        d->combine = !!vsapi->mapGetInt(in, "combine", 0, &err);
+
+        const auto numSigmaScales{ vsapi->mapNumElements(in, "sigma_scales") };
+        for (auto i{ 0 }; i < numSigmaScales; i++)
+            d->sigmaScales.push_back(vsapi->mapGetFloatSaturated(in, "sigma_scales", i, nullptr));
+        if (d->sigmaScales.empty())
+            d->sigmaScales.push_back(1.0f);
+
+        d->smode = vsapi->mapGetIntSaturated(in, "smode", 0, &err);
+
+        d->gamma = vsapi->mapGetFloatSaturated(in, "gamma", 0, &err);
+        if (err)
+            d->gamma = 1.0f;
+
+        d->dmax = vsapi->mapGetFloatSaturated(in, "dmax", 0, &err);
+
         const auto m{ vsapi->mapNumElements(in, "planes") };
 
         for (auto i{ 0 }; i < 3; i++)
@@ -561,24 +855,112 @@ static void VS_CC tcannyCreate(const VSMap* in, VSMap* out, [[maybe_unused]] voi
                 throw "sigma_v must be greater than or equal to 0.0"s;
         }
 
-        if (d->t_l >= d->t_h)
-            throw "t_h must be greater than t_l"s;
+        for (const auto& [t_h, t_l] : d->thresholdPairs) {
+            if (t_l >= t_h)
+                throw "t_h must be greater than t_l"s;
+        }
+
+        if (d->thresholdPairs.size() > 1 && d->mode != 0)
+            throw "more than one t_h and t_l can only be given when mode=0"s;
 
-        if (d->mode < -1 || d->mode > 1)
-            throw "mode must be -1, 0, or 1"s;
+        if (d->mode < -1 || d->mode > 4)
+            throw "mode must be -1, 0, 1, 2, 3, or 4"s;
 
         if (d->op < 0 || d->op > 6)
             throw "op must be 0, 1, 2, 3, 4, 5, or 6"s;
 
-        if (d->op == 5 && d->mode == 0)
-            throw "op=5 cannot be used when mode=0"s;
+        if (d->op == 5 && (d->mode == 0 || d->mode == 2 || d->mode == 4))
+            throw "op=5 cannot be used when mode=0, mode=2, or mode=4"s;
 
         if (d->scale <= 0.0f)
             throw "scale must be greater than 0.0"s;
 
+        if (d->gamma <= 0.0f)
+            throw "gamma must be greater than 0.0"s;
+
         if (opt < 0 || opt > 4)
             throw "opt must be 0, 1, 2, 3, or 4"s;
 
+        if (d->threads < 1)
+            throw "threads must be greater than or equal to 1"s;
+
+        if (d->hmode < 0 || d->hmode > 1)
+            throw "hmode must be 0 or 1"s;
+
+        if (d->tmode < 0 || d->tmode > 3)
+            throw "tmode must be 0, 1, 2, or 3"s;
+
+        if (d->tmode && d->mode != 0 && d->mode != 4)
+            throw "tmode can only be used when mode=0 or mode=4"s;
+
+        if ((d->tmode == 1 || d->tmode == 2) && d->thresholdPairs.size() > 1)
+            throw "tmode=1 and tmode=2 cannot be used with more than one t_h and t_l"s;
+
+        if (d->tpct < 0.0f || d->tpct > 100.0f)
+            throw "tpct must be between 0.0 and 100.0 (inclusive)"s;
+
+        if (d->expand < 0 || d->expand > maxExpand)
+            throw "expand must be between 0 and " + std::to_string(maxExpand) + " (inclusive)";
+
+        if (d->expand && d->mode != 0)
+            throw "expand can only be used when mode=0"s;
+
+        if (d->eshape < 0 || d->eshape > 2)
+            throw "eshape must be 0, 1, or 2"s;
+
+        if (d->outfmt < 0 || d->outfmt > 1)
+            throw "outfmt must be 0 or 1"s;
+
+        // 8 bit input is already in the format outfmt=1 asks for.
+        if (d->vi->format.sampleType == stInteger && d->vi->format.bitsPerSample == 8)
+            d->outfmt = 0;
+
+        if (d->outfmt == 1 && d->mode == -1)
+            throw "outfmt=1 cannot be used when mode=-1"s;
+
+        if (d->runs && d->mode != 0)
+            throw "runs can only be enabled when mode=0"s;
+
+        if (d->stats && d->mode == -1)
+            throw "stats cannot be enabled when mode=-1"s;
+
+        if (d->combine && (d->mode == -1 || d->mode == 4))
+            throw "combine cannot be enabled when mode=-1 or mode=4"s;
+
+        if (d->dmax < 0.0f)
+            throw "dmax must be greater than or equal to 0.0"s;
+
+        for (size_t i{ 0 }; i < d->sigmaScales.size(); i++) {
+            if (d->sigmaScales[i] <= 0.0f || (i && d->sigmaScales[i] <= d->sigmaScales[i - 1]))
+                throw "sigma_scales must be greater than 0.0 and in increasing order"s;
+        }
+
+        if (d->smode < 0 || d->smode > 2)
+            throw "smode must be 0, 1, or 2"s;
+
+        if (d->sigmaScales.size() > 1) {
+            if ((d->mode == -1 || d->mode == 4) && d->smode != 1)
+                throw "only smode=1 can be used when mode=-1 or mode=4"s;
+
+            if (d->smode == 2 && d->mode != 1 && d->mode != 2)
+                throw "smode=2 can only be used when mode=1 or mode=2"s;
+
+            if (d->thresholdPairs.size() > 1)
+                throw "more than one sigma_scales cannot be combined with more than one t_h and t_l"s;
+
+            if (d->tmode == 1 || d->tmode == 2)
+                throw "tmode=1 and tmode=2 cannot be used with more than one sigma_scales"s;
+        }
+
+        d->outVi = *d->vi;
+        if (d->outfmt == 1)
+            vsapi->queryVideoFormat(&d->outVi.format, d->vi->format.colorFamily, stInteger, 8, d->vi->format.subSamplingW, d->vi->format.subSamplingH, core);
+        if (d->combine)
+            vsapi->queryVideoFormat(&d->outVi.format, cfGray, d->outVi.format.sampleType, d->outVi.format.bitsPerSample, 0, 0, core);
+        d->outVi.height *= static_cast<int>(d->thresholdPairs.size());
+        if (d->smode == 1)
+            d->outVi.height *= static_cast<int>(d->sigmaScales.size());
+
         auto vectorSize{ 1 };
         {
             d->alignment = alignof(std::max_align_t);
@@ -601,100 +983,134 @@ static void VS_CC tcannyCreate(const VSMap* in, VSMap* out, [[maybe_unused]] voi
             }
 #endif
 
-            if (d->vi->format.bytesPerSample == 1) {
-                d->filter = filter_c<uint8_t>;
-
-#ifdef TCANNY_X86
-                if ((opt == 0 && iset >= 10) || opt == 4)
-                    d->filter = filter_avx512<uint8_t>;
-                else if ((opt == 0 && iset >= 8) || opt == 3)
-                    d->filter = filter_avx2<uint8_t>;
-                else
-#endif
-#if defined(TCANNY_X86) || defined(TCANNY_ARM)
-                if ((opt == 0 && iset >= 2) || opt == 2)
-                    d->filter = filter_sse2<uint8_t>;
-#endif
-            } else if (d->vi->format.bytesPerSample == 2) {
-                d->filter = filter_c<uint16_t>;
-
-#ifdef TCANNY_X86
-                if ((opt == 0 && iset >= 10) || opt == 4)
-                    d->filter = filter_avx512<uint16_t>;
-                else if ((opt == 0 && iset >= 8) || opt == 3)
-                    d->filter = filter_avx2<uint16_t>;
-                else
-#endif
-#if defined(TCANNY_X86) || defined(TCANNY_ARM)
-                if ((opt == 0 && iset >= 2) || opt == 2)
-                    d->filter = filter_sse2<uint16_t>;
-#endif
-            } else {
-                d->filter = filter_c<float>;
-
-#ifdef TCANNY_X86
-                if ((opt == 0 && iset >= 10) || opt == 4)
-                    d->filter = filter_avx512<float>;
-                else if ((opt == 0 && iset >= 8) || opt == 3)
-                    d->filter = filter_avx2<float>;
-                else
-#endif
-#if defined(TCANNY_X86) || defined(TCANNY_ARM)
-                if ((opt == 0 && iset >= 2) || opt == 2)
-                    d->filter = filter_sse2<float>;
-#endif
-            }
+            if (d->vi->format.bytesPerSample == 1)
+                d->filter = selectFilter<uint8_t, uint8_t>(opt);
+            else if (d->vi->format.sampleType == stInteger)
+                d->filter = d->outfmt ? selectFilter<uint16_t, uint8_t>(opt) : selectFilter<uint16_t, uint16_t>(opt);
+            else if (d->vi->format.bytesPerSample == 2)
+                d->filter = d->outfmt ? selectFilter<half, uint8_t>(opt) : selectFilter<half, half>(opt);
+            else
+                d->filter = d->outfmt ? selectFilter<float, uint8_t>(opt) : selectFilter<float, float>(opt);
         }
 
         VSCoreInfo info;
         vsapi->getCoreInfo(core, &info);
 
-        d->blur.reserve(info.numThreads);
-        d->gradient.reserve(info.numThreads);
-        d->direction.reserve(info.numThreads);
-        d->found.reserve(info.numThreads);
+        if ((d->mode == 0 || d->mode == 4) && d->hmode == 0 && d->threads > 1) {
+            try {
+                d->pool = std::make_unique<WorkerPool>(d->threads - 1);
+            } catch (...) {
+                throw "failed to create worker threads"s;
+            }
+        }
 
         if (d->vi->format.sampleType == stInteger) {
             d->peak = (1 << d->vi->format.bitsPerSample) - 1;
             auto scale{ d->peak / 255.0f };
-            d->t_h *= scale;
-            d->t_l *= scale;
+            for (auto& [t_h, t_l] : d->thresholdPairs) {
+                t_h *= scale;
+                t_l *= scale;
+            }
+            d->statsScale = 1.0f / scale;
         } else {
-            d->t_h /= 255.0f;
-            d->t_l /= 255.0f;
+            for (auto& [t_h, t_l] : d->thresholdPairs) {
+                t_h /= 255.0f;
+                t_l /= 255.0f;
+            }
+            d->statsScale = 255.0f;
         }
 
+        d->t_h = fltMax;
+        d->t_l = fltMax;
+        for (const auto& [t_h, t_l] : d->thresholdPairs) {
+            d->t_h = std::min(d->t_h, t_h);
+            d->t_l = std::min(d->t_l, t_l);
+        }
+
+        d->outScale = 1.0f;
+        if (d->outfmt == 1) {
+            d->outScale = 255.0f / (d->vi->format.sampleType == stInteger ? d->peak : 1.0f);
+            d->peak = 255;
+        }
+
+        // The soft ramp of mode 3 maps t_l to 0 and t_h to the peak of the output format.
+        const auto rampPeak{ (d->vi->format.sampleType == stInteger || d->outfmt) ? static_cast<float>(d->peak) : 1.0f };
+        d->rampScale = rampPeak / (d->t_h - d->t_l);
+        d->rampOffset = (d->mode == 3) ? -d->t_l * d->rampScale : 0.0f;
+
+        d->scaleSteps.resize(d->sigmaScales.size() - 1);
+
         for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
             if (d->process[plane]) {
                 auto planeOrder{ plane == 0 ? "first" : (plane == 1 ? "second" : "third") };
 
-                if (sigmaH[plane]) {
-                    d->weightsH[plane].reset(gaussianWeights(sigmaH[plane], d->radiusH[plane]));
+                auto width{ d->vi->width >> (plane ? d->vi->format.subSamplingW : 0) };
+                auto height{ d->vi->height >> (plane ? d->vi->format.subSamplingH : 0) };
 
-                    auto width{ d->vi->width >> (plane ? d->vi->format.subSamplingW : 0) };
-                    if (width < d->radiusH[plane] + 1)
-                        throw "the "s + planeOrder + " plane's width must be at least " + std::to_string(d->radiusH[plane] + 1) + " for specified sigma";
-                }
+                // Every further scale is blurred from the previous one, so its kernel only adds the difference of their variances.
+                for (size_t k{ 0 }; k < d->sigmaScales.size(); k++) {
+                    const auto factor{ k ? std::sqrt(d->sigmaScales[k] * d->sigmaScales[k] - d->sigmaScales[k - 1] * d->sigmaScales[k - 1])
+                                         : d->sigmaScales[0] };
+                    auto& radiusH{ k ? d->scaleSteps[k - 1].radiusH[plane] : d->radiusH[plane] };
+                    auto& radiusV{ k ? d->scaleSteps[k - 1].radiusV[plane] : d->radiusV[plane] };
+
+                    if (sigmaH[plane]) {
+                        (k ? d->scaleSteps[k - 1].weightsH[plane] : d->weightsH[plane]).reset(gaussianWeights(sigmaH[plane] * factor, radiusH));
+
+                        if (width < radiusH + 1)
+                            throw "the "s + planeOrder + " plane's width must be at least " + std::to_string(radiusH + 1) + " for specified sigma";
+                    }
 
-                if (sigmaV[plane]) {
-                    d->weightsV[plane].reset(gaussianWeights(sigmaV[plane], d->radiusV[plane]));
+                    if (sigmaV[plane]) {
+                        (k ? d->scaleSteps[k - 1].weightsV[plane] : d->weightsV[plane]).reset(gaussianWeights(sigmaV[plane] * factor, radiusV));
 
-                    auto height{ d->vi->height >> (plane ? d->vi->format.subSamplingH : 0) };
-                    if (height < d->radiusV[plane] + 1)
-                        throw "the "s + planeOrder + " plane's height must be at least " + std::to_string(d->radiusV[plane] + 1) + " for specified sigma_v";
+                        if (height < radiusV + 1)
+                            throw "the "s + planeOrder + " plane's height must be at least " + std::to_string(radiusV + 1) + " for specified sigma_v";
+                    }
                 }
             }
         }
 
-        d->radiusAlign = (std::max({ d->radiusH[0], d->radiusH[1], d->radiusH[2], d->op == FDOG ? 2 : 1 }) + vectorSize - 1) & ~(vectorSize - 1);
+        auto radiusH{ std::max({ d->radiusH[0], d->radiusH[1], d->radiusH[2], d->op == FDOG ? 2 : 1 }) };
+        for (const auto& step : d->scaleSteps)
+            radiusH = std::max({ radiusH, step.radiusH[0], step.radiusH[1], step.radiusH[2] });
+
+        d->radiusAlign = (radiusH + vectorSize - 1) & ~(vectorSize - 1);
+
+        auto srcFrame{ vsapi->newVideoFrame(&d->vi->format, d->vi->width, d->vi->height, nullptr, core) };
+        auto dstFrame{ vsapi->newVideoFrame(&d->outVi.format, d->outVi.width, d->vi->height, nullptr, core) };
+        const auto stride{ static_cast<int>(vsapi->getStride(srcFrame, 0) / d->vi->format.bytesPerSample) };
+        const auto dstStride{ vsapi->getStride(dstFrame, 0) };
+        vsapi->freeFrame(srcFrame);
+        vsapi->freeFrame(dstFrame);
+
+        // The sets are grown to what this instance needs before it gets any frame, so frames never allocate them. Sets in use by the frames of
+        // other instances are waited for, and the lock keeps two instances from growing them at the same time.
+        std::lock_guard<std::mutex> lock{ sharedScratchMutex };
+        for (auto it{ sharedScratch.begin() }; it != sharedScratch.end();)
+            it = it->second.expired() ? sharedScratch.erase(it) : std::next(it);
+
+        auto& shared{ sharedScratch[core] };
+        d->scratch = shared.lock();
+
+        if (!d->scratch) {
+            d->scratch = std::make_shared<TCannyScratchPool>(info.numThreads);
+            shared = d->scratch;
+        }
+
+        d->scratch->forEach([&](TCannyScratch& scratch) { allocateScratch(scratch, d.get(), stride, dstStride); });
     } catch (const std::string& error) {
         vsapi->mapSetError(out, ("TCanny: " + error).c_str());
         vsapi->freeNode(d->node);
         return;
+    } catch (const std::bad_alloc&) {
+        vsapi->mapSetError(out, "TCanny: malloc failure");
+        vsapi->freeNode(d->node);
+        return;
     }
 
     VSFilterDependency deps[]{ {d->node, rpStrictSpatial} };
-    vsapi->createVideoFilter(out, "TCanny", d->vi, tcannyGetFrame, tcannyFree, fmParallel, deps, 1, d.get(), core);
+    vsapi->createVideoFilter(out, "TCanny", &d->outVi, tcannyGetFrame, tcannyFree, fmParallel, deps, 1, d.get(), core);
     d.release();
 }
 
@@ -707,13 +1123,27 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI
                              "clip:vnode;"
                              "sigma:float[]:opt;"
                              "sigma_v:float[]:opt;"
-                             "t_h:float:opt;"
-                             "t_l:float:opt;"
+                             "t_h:float[]:opt;"
+                             "t_l:float[]:opt;"
                              "mode:int:opt;"
                              "op:int:opt;"
                              "scale:float:opt;"
                              "opt:int:opt;"
-                             "planes:int[]:opt;",
+                             "planes:int[]:opt;"
+                             "threads:int:opt;"
+                             "hmode:int:opt;"
+                             "tmode:int:opt;"
+                             "tpct:float:opt;"
+                             "expand:int:opt;"
+                             "eshape:int:opt;"
+                             "outfmt:int:opt;"
+                             "runs:int:opt;"
+                             "stats:int:opt;"
+                             "combine:int:opt;"
+                             "sigma_scales:float[]:opt;"
+                             "smode:int:opt;"
+                             "gamma:float:opt;"
+                             "dmax:float:opt;",
                              "clip:vnode;",
                              tcannyCreate, nullptr, plugin);
 }
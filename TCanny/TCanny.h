@@ -1,11 +1,17 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <thread>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -13,6 +19,7 @@
 #include <VSHelper4.h>
 
 #if defined(TCANNY_X86) || defined(TCANNY_ARM)
+#include "VCL2/vectormath_exp.h"
 #include "VCL2/vectormath_trig.h"
 #endif
 
@@ -27,8 +34,166 @@ static constexpr float M_1_PIF = 0.318309886183790671538f;
 static constexpr float fltMax = std::numeric_limits<float>::max();
 static constexpr float fltLowest = std::numeric_limits<float>::lowest();
 
-using unique_float = std::unique_ptr<float[], decltype(&vsh::vsh_aligned_free)>;
-using unique_int = std::unique_ptr<int[], decltype(&vsh::vsh_aligned_free)>;
+static constexpr int activityTileSize = 32;
+static constexpr int hysteresisTileWidth = 512;
+static constexpr int hysteresisTileHeight = 128;
+static constexpr int histogramBins = 1024;
+static constexpr int maxExpand = 64;
+
+// Sample type of 16 bit float clips. It only holds the bits, so every load and store has to go through the conversions below.
+enum class half : uint16_t {};
+
+static inline float halfToFloat(const half value) noexcept {
+    constexpr uint32_t shiftedExponent{ 0x7C00 << 13 };
+    constexpr uint32_t denormalMagic{ 113 << 23 };
+
+    auto bits{ (static_cast<uint32_t>(value) & 0x7FFF) << 13 };
+    const auto exponent{ bits & shiftedExponent };
+    bits += (127 - 15) << 23;
+
+    float result;
+    if (exponent == shiftedExponent) {
+        bits += (128 - 16) << 23;
+        std::memcpy(&result, &bits, sizeof(bits));
+    } else if (exponent == 0) {
+        bits += 1 << 23;
+        float magic;
+        std::memcpy(&result, &bits, sizeof(bits));
+        std::memcpy(&magic, &denormalMagic, sizeof(magic));
+        result -= magic;
+    } else {
+        std::memcpy(&result, &bits, sizeof(bits));
+    }
+
+    return (static_cast<uint32_t>(value) & 0x8000) ? -result : result;
+}
+
+// Rounds to nearest even like vcvtps2ph does.
+static inline half floatToHalf(const float value) noexcept {
+    constexpr uint32_t infinity{ 255 << 23 };
+    constexpr uint32_t halfOverflow{ (127 + 16) << 23 };
+    constexpr uint32_t denormalMagic{ ((127 - 15) + (23 - 10) + 1) << 23 };
+
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const auto sign{ bits & 0x80000000 };
+    bits ^= sign;
+
+    uint32_t result;
+    if (bits >= halfOverflow) {
+        result = (bits > infinity) ? 0x7E00 : 0x7C00;
+    } else if (bits < (113 << 23)) {
+        float f, magic;
+        std::memcpy(&f, &bits, sizeof(f));
+        std::memcpy(&magic, &denormalMagic, sizeof(magic));
+        f += magic;
+        std::memcpy(&result, &f, sizeof(result));
+        result -= denormalMagic;
+    } else {
+        const auto mantissaOdd{ (bits >> 13) & 1 };
+        bits -= (127 - 15) << 23;
+        bits += 0xFFF + mantissaOdd;
+        result = bits >> 13;
+    }
+
+    return static_cast<half>(result | (sign >> 16));
+}
+
+template<typename pixel_t>
+static inline float toFloat(const pixel_t value) noexcept {
+    if constexpr (std::is_same_v<pixel_t, half>)
+        return halfToFloat(value);
+    else
+        return value;
+}
+
+class WorkerPool final {
+public:
+    explicit WorkerPool(const int numWorkers) {
+        for (auto i{ 0 }; i < numWorkers; i++)
+            workers.emplace_back(&WorkerPool::workerLoop, this);
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock{ mtx };
+            quit = true;
+        }
+        wakeCv.notify_all();
+
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    // Runs task(i) for every i in [0, count) on the workers and the calling thread.
+    // If another frame currently owns the pool, the calling thread does all the work by itself.
+    template<typename F>
+    void run(const int count, F&& task) noexcept {
+        std::unique_lock<std::mutex> owner{ busy, std::try_to_lock };
+        if (!owner.owns_lock() || workers.empty()) {
+            for (auto i{ 0 }; i < count; i++)
+                task(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{ mtx };
+            fn = [](void* ctx, const int i) { (*static_cast<std::remove_reference_t<F>*>(ctx))(i); };
+            ctx = &task;
+            next = 0;
+            numTasks = count;
+            active = static_cast<int>(workers.size());
+            generation++;
+        }
+        wakeCv.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> lock{ mtx };
+        doneCv.wait(lock, [this] { return active == 0; });
+    }
+
+private:
+    void work() noexcept {
+        for (auto i{ next++ }; i < numTasks; i = next++)
+            fn(ctx, i);
+    }
+
+    void workerLoop() noexcept {
+        auto seen{ 0u };
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock{ mtx };
+                wakeCv.wait(lock, [&] { return quit || generation != seen; });
+                if (quit)
+                    return;
+                seen = generation;
+            }
+
+            work();
+
+            {
+                std::lock_guard<std::mutex> lock{ mtx };
+                if (--active == 0)
+                    doneCv.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex busy;
+    std::mutex mtx;
+    std::condition_variable wakeCv;
+    std::condition_variable doneCv;
+    void (*fn)(void*, int) {};
+    void* ctx{};
+    std::atomic<int> next{};
+    int numTasks{};
+    int active{};
+    unsigned generation{};
+    bool quit{};
+};
 
 enum Operator {
     TRITICAL,
@@ -40,63 +205,1024 @@ enum Operator {
     FDOG
 };
 
+struct TCannyStats final {
+    int edgeCount;
+    double gradSum;
+    float gradMax;
+    double orientation[4];
+};
+
+// Aligned memory that is only reallocated when it is asked for more elements or a stricter alignment than it already has. The scratch sets
+// are shared by all filters of a core, so every buffer ends up as large as the most demanding filter needs it.
+template<typename T>
+class ScratchBuffer final {
+public:
+    bool reserve(const size_t count, const size_t alignment) noexcept {
+        if (count <= capacity && alignment <= this->alignment)
+            return true;
+
+        data.reset(vsh::vsh_aligned_malloc<T>(count * sizeof(T), alignment));
+        capacity = data ? count : 0;
+        this->alignment = data ? alignment : 0;
+        return !!data;
+    }
+
+    T* get() const noexcept { return data.get(); }
+
+private:
+    std::unique_ptr<T[], decltype(&vsh::vsh_aligned_free)> data{ nullptr, vsh::vsh_aligned_free };
+    size_t capacity{};
+    size_t alignment{};
+};
+
+struct TCannyScratch final {
+    ScratchBuffer<float> blur;
+    ScratchBuffer<float> blur2;
+    ScratchBuffer<float> gradient;
+    ScratchBuffer<int> direction;
+    ScratchBuffer<uint8_t> planeOut[2];
+    ScratchBuffer<uint8_t> scaleOut;
+    ScratchBuffer<float> activity;
+    ScratchBuffer<float> contrast;
+    ScratchBuffer<float> scaleRow;
+    ScratchBuffer<int> parabolas;
+    ScratchBuffer<double> boundaries;
+    ScratchBuffer<const void*> rows;
+    std::vector<uint32_t> seeds;
+    std::vector<uint32_t> pairSeeds;
+    std::vector<uint32_t> spans;
+    std::vector<uint32_t> borders;
+    std::vector<uint8_t> runs[3];
+    std::vector<int> histogram;
+    std::vector<uint8_t> expandDist;
+    std::vector<int> expandEnds;
+    std::vector<float> suppressed;
+    TCannyStats stats[3]{};
+    float thresholds[3][2]{};
+};
+
+// A fixed number of scratch sets that frames check out and back in. One pool is shared by all filters of a core. The free sets form a lock-free
+// stack of indices, whose head also carries a counter that every change bumps, so that a pop can't succeed on a stale head after the same index
+// has been popped and pushed again. When more frames are in flight than there are sets, acquire sleeps until one is released.
+class TCannyScratchPool final {
+public:
+    explicit TCannyScratchPool(const int size) : sets(size), next(size) {
+        for (auto i{ 0 }; i < size; i++)
+            next[i].store(i + 1, std::memory_order_relaxed);
+        head.store(0);
+    }
+
+    TCannyScratch* acquire() {
+        if (auto scratch{ tryAcquire() })
+            return scratch;
+
+        std::unique_lock<std::mutex> lock{ mtx };
+        waiting++;
+
+        TCannyScratch* scratch;
+        cv.wait(lock, [&] { return (scratch = tryAcquire()) != nullptr; });
+
+        waiting--;
+        return scratch;
+    }
+
+    void release(TCannyScratch* scratch) {
+        const auto index{ static_cast<uint32_t>(scratch - sets.data()) };
+        auto old{ head.load(std::memory_order_relaxed) };
+
+        do {
+            next[index].store(static_cast<uint32_t>(old), std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(old, (((old >> 32) + 1) << 32) | index));
+
+        // A waiter counts itself before it last looks at the stack, so either it sees this set or it is counted here. Taking the lock makes
+        // sure it is already asleep before it is woken.
+        if (waiting.load()) {
+            std::lock_guard<std::mutex> lock{ mtx };
+            cv.notify_one();
+        }
+    }
+
+    // Checks a set out for as long as it lives, so that the set also goes back when the frame fails.
+    class Lease final {
+    public:
+        explicit Lease(TCannyScratchPool& pool) : pool{ pool }, scratch{ pool.acquire() } {}
+        ~Lease() { pool.release(scratch); }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        TCannyScratch* get() const noexcept { return scratch; }
+        TCannyScratch* operator->() const noexcept { return scratch; }
+
+    private:
+        TCannyScratchPool& pool;
+        TCannyScratch* scratch;
+    };
+
+    // Checks out every set before f is called on them, so that they can be changed while other threads are filtering frames.
+    template<typename F>
+    void forEach(F&& f) {
+        std::vector<TCannyScratch*> held;
+        held.reserve(sets.size());
+
+        try {
+            while (held.size() < sets.size())
+                held.push_back(acquire());
+
+            for (auto scratch : held)
+                f(*scratch);
+        } catch (...) {
+            for (auto scratch : held)
+                release(scratch);
+            throw;
+        }
+
+        for (auto scratch : held)
+            release(scratch);
+    }
+
+private:
+    TCannyScratch* tryAcquire() noexcept {
+        auto old{ head.load() };
+
+        for (;;) {
+            const auto index{ static_cast<uint32_t>(old) };
+            if (index == sets.size())
+                return nullptr;
+
+            const auto desired{ (((old >> 32) + 1) << 32) | next[index].load(std::memory_order_relaxed) };
+            if (head.compare_exchange_weak(old, desired))
+                return &sets[index];
+        }
+    }
+
+    std::vector<TCannyScratch> sets;
+    std::vector<std::atomic<uint32_t>> next;
+    std::atomic<uint64_t> head;
+    std::atomic<int> waiting{};
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// The kernels that blur one scale into the next, with the variance the two scales differ by.
+struct TCannyScaleStep final {
+    int radiusH[3]{};
+    int radiusV[3]{};
+    std::unique_ptr<float[]> weightsH[3];
+    std::unique_ptr<float[]> weightsV[3];
+};
+
 struct TCannyData final {
     VSNode* node;
     const VSVideoInfo* vi;
+    VSVideoInfo outVi;
     float t_h;
     float t_l;
+    std::vector<std::pair<float, float>> thresholdPairs;
     int mode;
     int op;
     float scale;
     bool process[3];
     int peak;
+    int threads;
+    int hmode;
+    int tmode;
+    float tpct;
+    int expand;
+    int eshape;
+    float dmax;
+    int outfmt;
+    bool combine;
+    bool runs;
+    bool stats;
+    float statsScale;
+    float outScale;
+    float gamma;
+    float rampScale;
+    float rampOffset;
     int radiusAlign;
     int radiusH[3];
     int radiusV[3];
     size_t alignment;
     std::unique_ptr<float[]> weightsH[3];
     std::unique_ptr<float[]> weightsV[3];
-    std::unordered_map<std::thread::id, std::unique_ptr<bool[]>> found;
-    std::unordered_map<std::thread::id, unique_float> blur;
-    std::unordered_map<std::thread::id, unique_float> gradient;
-    std::unordered_map<std::thread::id, unique_int> direction;
-    void (*filter)(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept;
+    std::vector<float> sigmaScales;
+    int smode;
+    std::vector<TCannyScaleStep> scaleSteps;
+    std::shared_ptr<TCannyScratchPool> scratch;
+    std::unique_ptr<WorkerPool> pool;
+    void (*filter)(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch,
+                   const VSAPI* vsapi);
 };
 
-static void hysteresis(float* VS_RESTRICT srcp, bool* VS_RESTRICT found, const int width, const int height, const ptrdiff_t stride,
-                       const float t_h, const float t_l) noexcept {
-    std::fill_n(found, width * height, false);
-    std::vector<std::pair<int, int>> coordinates;
+template<typename pixel_t>
+static inline pixel_t edgeValue(const int peak) noexcept {
+    if constexpr (std::is_integral_v<pixel_t>)
+        return static_cast<pixel_t>(peak);
+    else if constexpr (std::is_same_v<pixel_t, half>)
+        return floatToHalf(1.0f);
+    else
+        return 1.0f;
+}
 
+// Picks t_h from the histogram of the magnitudes left by nonMaximumSuppression, either by Otsu's method or as the given percentile, keeps the
+// ratio of t_l to t_h and drops the seeds that fall below the new t_h. Returns false and leaves t_h and t_l alone when no magnitude is left to
+// pick from.
+static bool autoThresholds(const std::vector<int>& histogram, std::vector<uint32_t>& seeds, const float* blur, const float binScale, const int tmode,
+                           const float percentile, const float ratio, float& t_h, float& t_l) {
+    auto total{ 0.0 };
+    auto sumAll{ 0.0 };
+    for (auto i{ 0 }; i < histogramBins; i++) {
+        total += histogram[i];
+        sumAll += static_cast<double>(i) * histogram[i];
+    }
+
+    if (total == 0.0)
+        return false;
+
+    auto k{ 0 };
+
+    if (tmode == 1) {
+        auto weightB{ 0.0 };
+        auto sumB{ 0.0 };
+        auto bestVariance{ -1.0 };
+
+        for (auto i{ 0 }; i < histogramBins; i++) {
+            weightB += histogram[i];
+            sumB += static_cast<double>(i) * histogram[i];
+
+            const auto weightF{ total - weightB };
+            if (weightB == 0.0)
+                continue;
+            if (weightF == 0.0)
+                break;
+
+            const auto diff{ sumB / weightB - (sumAll - sumB) / weightF };
+            const auto variance{ weightB * weightF * diff * diff };
+            if (variance > bestVariance) {
+                bestVariance = variance;
+                k = i + 1;
+            }
+        }
+    } else {
+        const auto target{ total * percentile / 100.0 };
+        auto cumulative{ 0.0 };
+
+        while (k < histogramBins) {
+            cumulative += histogram[k++];
+            if (cumulative >= target)
+                break;
+        }
+    }
+
+    t_h = k / binScale;
+    t_l = t_h * ratio;
+    seeds.erase(std::remove_if(seeds.begin(), seeds.end(), [&](const uint32_t pos) noexcept { return blur[pos] < t_h; }), seeds.end());
+    return true;
+}
+
+// Turns the per-tile gradient sums gathered by detectEdge into the factors the thresholds of tmode=3 are scaled with, the mean of the tile
+// relative to the mean of the plane clamped to [1/4, 4]. The activity map is divided by the smallest factor around each tile, since
+// nonMaximumSuppression divides the magnitudes by the interpolated factors and the activity map has to stay an upper bound of them.
+static void adaptiveScales(float* VS_RESTRICT contrast, float* VS_RESTRICT activity, const int width, const int height, const int tilesX) noexcept {
+    const auto tilesY{ (height + activityTileSize - 1) / activityTileSize };
+    const auto mean{ std::accumulate(contrast, contrast + tilesX * tilesY, 0.0) / (static_cast<double>(width) * height) };
+
+    for (auto ty{ 0 }; ty < tilesY; ty++) {
+        for (auto tx{ 0 }; tx < tilesX; tx++) {
+            const auto tileWidth{ std::min(activityTileSize, width - tx * activityTileSize) };
+            const auto tileHeight{ std::min(activityTileSize, height - ty * activityTileSize) };
+            auto& factor{ contrast[ty * tilesX + tx] };
+            factor = (mean > 0.0) ? static_cast<float>(std::clamp(factor / (tileWidth * tileHeight) / mean, 0.25, 4.0)) : 1.0f;
+        }
+    }
+
+    for (auto ty{ 0 }; ty < tilesY; ty++) {
+        for (auto tx{ 0 }; tx < tilesX; tx++) {
+            auto lowest{ fltMax };
+            for (auto ny{ std::max(ty - 1, 0) }; ny <= std::min(ty + 1, tilesY - 1); ny++)
+                for (auto nx{ std::max(tx - 1, 0) }; nx <= std::min(tx + 1, tilesX - 1); nx++)
+                    lowest = std::min(lowest, contrast[ny * tilesX + nx]);
+
+            activity[ty * tilesX + tx] /= lowest;
+        }
+    }
+}
+
+// Fills row with the reciprocals of the threshold factors of row y, bilinearly interpolated between the tile centers.
+static void interpolateScales(const float* contrast, float* VS_RESTRICT row, const int y, const int width, const int height, const int tilesX) noexcept {
+    const auto tilesY{ (height + activityTileSize - 1) / activityTileSize };
+    const auto fy{ std::clamp((y + 0.5f) / activityTileSize - 0.5f, 0.0f, tilesY - 1.0f) };
+    const auto ty{ static_cast<int>(fy) };
+    const auto wy{ fy - ty };
+    auto top{ contrast + ty * tilesX };
+    auto bottom{ contrast + std::min(ty + 1, tilesY - 1) * tilesX };
+
+    for (auto x{ 0 }; x < width; x++) {
+        const auto fx{ std::clamp((x + 0.5f) / activityTileSize - 0.5f, 0.0f, tilesX - 1.0f) };
+        const auto tx{ static_cast<int>(fx) };
+        const auto tx1{ std::min(tx + 1, tilesX - 1) };
+        const auto wx{ fx - tx };
+        const auto left{ top[tx] + (bottom[tx] - top[tx]) * wy };
+        const auto right{ top[tx1] + (bottom[tx1] - top[tx1]) * wy };
+        row[x] = 1.0f / (left + (right - left) * wx);
+    }
+}
+
+template<typename T>
+static void maxPlane(const T* srcp, T* VS_RESTRICT dstp, const int width, const int height, const ptrdiff_t stride, const int ssW, const int ssH) noexcept {
     for (auto y{ 0 }; y < height; y++) {
-        for (auto x{ 0 }; x < width; x++) {
-            if (!found[width * y + x] && srcp[stride * y + x] >= t_h) {
-                srcp[stride * y + x] = fltMax;
-                found[width * y + x] = true;
+        auto row{ srcp + stride * (y >> ssH) };
+
+        for (auto x{ 0 }; x < width; x++)
+            dstp[x] = std::max(dstp[x], row[x >> ssW]);
+
+        dstp += stride;
+    }
+}
+
+template<typename pixel_t>
+static int countEdges(const pixel_t* srcp, const int width, const int height, const ptrdiff_t stride) noexcept {
+    auto count{ 0 };
+
+    for (auto y{ 0 }; y < height; y++) {
+        count += static_cast<int>(std::count_if(srcp, srcp + width, [](const pixel_t value) noexcept { return value != pixel_t{}; }));
+        srcp += stride;
+    }
+
+    return count;
+}
+
+// The hysteresis functions write the edges straight into dstp, which must be zero-filled beforehand, and return the number of edge pixels.
+
+// Scanline flood fill. Every entry on the stack is the linear index of the first pixel of a whole run of weak pixels, so the stack stays small
+// even on dense edge maps. Visited pixels are recognized by the fltMax they get marked with, which can never come out of nonMaximumSuppression.
+// Since a run is always filled up to the next pixel below t_l, its end is found again by walking the fltMax pixels when it is popped.
+// To stay in cache, the plane is first filled tile by tile without leaving the tile. Runs that reach an inner tile border are recorded, and
+// their neighbors in the adjacent tiles are flood filled afterwards without restriction. The fills start from seeds, the row-major list of
+// pixels >= t_h collected by nonMaximumSuppression, so the plane itself is never scanned. This is the only sparse stage, detectEdge and
+// nonMaximumSuppression still visit every pixel of the tiles whose activity reaches t_l.
+template<typename pixel_t>
+static int hysteresis(float* VS_RESTRICT srcp, pixel_t* VS_RESTRICT dstp, const std::vector<uint32_t>& seeds, std::vector<uint32_t>& spans,
+                       std::vector<uint32_t>& borders, const int width, const int height, const ptrdiff_t stride, const ptrdiff_t dstStride,
+                       const float t_l, const int peak) {
+    const auto edge{ edgeValue<pixel_t>(peak) };
+    auto count{ 0 };
+    spans.clear();
+    borders.clear();
 
-                coordinates.emplace_back(std::make_pair(x, y));
+    auto isWeak{ [&](const int x, const int y) { return srcp[stride * y + x] >= t_l && srcp[stride * y + x] != fltMax; } };
 
-                while (!coordinates.empty()) {
-                    const auto& pos{ coordinates.back() };
-                    coordinates.pop_back();
+    auto fill{ [&](const int x, const int y, const int xMin, const int xMax, const int yMin, const int yMax) {
+        auto fillRun{ [&](const int x, const int y) {
+            auto xStart{ x };
+            auto xStop{ x };
 
-                    const auto xxStart{ std::max(pos.first - 1, 0) };
-                    const auto xxStop{ std::min(pos.first + 1, width - 1) };
-                    const auto yyStart{ std::max(pos.second - 1, 0) };
-                    const auto yyStop{ std::min(pos.second + 1, height - 1) };
+            while (xStart > xMin && isWeak(xStart - 1, y))
+                xStart--;
+            while (xStop < xMax && isWeak(xStop + 1, y))
+                xStop++;
+
+            std::fill(srcp + stride * y + xStart, srcp + stride * y + xStop + 1, fltMax);
+            std::fill(dstp + dstStride * y + xStart, dstp + dstStride * y + xStop + 1, edge);
+            count += xStop - xStart + 1;
+
+            spans.push_back(static_cast<uint32_t>(stride * y + xStart));
+            if ((xStart == xMin && xMin > 0) || (xStop == xMax && xMax < width - 1) || (y == yMin && yMin > 0) || (y == yMax && yMax < height - 1))
+                borders.push_back(static_cast<uint32_t>(stride * y + xStart));
+            return xStop;
+        } };
+
+        fillRun(x, y);
+
+        while (!spans.empty()) {
+            const auto pos{ spans.back() };
+            spans.pop_back();
+
+            const auto yy0{ static_cast<int>(pos / stride) };
+            const auto xStart{ static_cast<int>(pos % stride) };
+            auto xStop{ xStart };
+            while (xStop < xMax && srcp[pos + xStop + 1 - xStart] == fltMax)
+                xStop++;
+
+            const auto xxStart{ std::max(xStart - 1, xMin) };
+            const auto xxStop{ std::min(xStop + 1, xMax) };
+
+            for (auto yy{ yy0 - 1 }; yy <= yy0 + 1; yy += 2) {
+                if (yy < yMin || yy > yMax)
+                    continue;
+
+                for (auto xx{ xxStart }; xx <= xxStop; xx++) {
+                    if (isWeak(xx, yy))
+                        xx = fillRun(xx, yy);
+                }
+            }
+        }
+    } };
+
+    auto first{ seeds.cbegin() };
+
+    for (auto yMin{ 0 }; yMin < height; yMin += hysteresisTileHeight) {
+        const auto yMax{ std::min(yMin + hysteresisTileHeight, height) - 1 };
+        const auto last{ std::lower_bound(first, seeds.cend(), static_cast<uint32_t>(stride * (yMax + 1))) };
+
+        for (auto xMin{ 0 }; xMin < width; xMin += hysteresisTileWidth) {
+            const auto xMax{ std::min(xMin + hysteresisTileWidth, width) - 1 };
+
+            for (auto seed{ first }; seed != last; seed++) {
+                const auto x{ static_cast<int>(*seed % stride) };
+                if (x >= xMin && x <= xMax && srcp[*seed] != fltMax)
+                    fill(x, static_cast<int>(*seed / stride), xMin, xMax, yMin, yMax);
+            }
+        }
+
+        first = last;
+    }
+
+    for (size_t i{ 0 }; i < borders.size(); i++) {
+        const auto pos{ borders[i] };
+        const auto yy0{ static_cast<int>(pos / stride) };
+        const auto xStart{ static_cast<int>(pos % stride) };
+        auto xStop{ xStart };
+        while (xStop < width - 1 && srcp[pos + xStop + 1 - xStart] == fltMax)
+            xStop++;
+
+        const auto xxStart{ std::max(xStart - 1, 0) };
+        const auto xxStop{ std::min(xStop + 1, width - 1) };
+
+        for (auto yy{ std::max(yy0 - 1, 0) }; yy <= std::min(yy0 + 1, height - 1); yy++) {
+            for (auto xx{ xxStart }; xx <= xxStop; xx++) {
+                if (isWeak(xx, yy))
+                    fill(xx, yy, 0, width - 1, 0, height - 1);
+            }
+        }
+    }
+
+    return count;
+}
+
+static inline int findRoot(int* VS_RESTRICT label, int p) noexcept {
+    while (label[p] >= 0) {
+        if (label[label[p]] >= 0)
+            label[p] = label[label[p]];
+        p = label[p];
+    }
+    return p;
+}
+
+static inline void unite(int* VS_RESTRICT label, int p, int q) noexcept {
+    p = findRoot(label, p);
+    q = findRoot(label, q);
+
+    if (p != q) {
+        if (p > q)
+            std::swap(p, q);
+
+        label[p] = (label[p] == -2 || label[q] == -2) ? -2 : -1;
+        label[q] = p;
+    }
+}
+
+// Connected-component variant of hysteresis. Pixels >= t_l are labelled per band of rows in parallel with a union-find forest stored in label,
+// where a root holds -2 if its component contains a pixel >= t_h and -1 otherwise. The bands are then merged along their borders and every
+// pixel whose component is strong gets marked.
+template<typename pixel_t>
+static int hysteresisLabel(const float* srcp, pixel_t* VS_RESTRICT dstp, int* VS_RESTRICT label, const int width, const int height,
+                            const ptrdiff_t stride, const ptrdiff_t dstStride, const ptrdiff_t labelStride, const float t_h, const float t_l,
+                            const int peak, WorkerPool* pool, const int threads) noexcept {
+    const auto edge{ edgeValue<pixel_t>(peak) };
+    const auto numBands{ std::min(threads * 2, height) };
+    std::atomic<int> count{};
+    const auto bandHeight{ (height + numBands - 1) / numBands };
+
+    pool->run(numBands, [&](const int band) {
+        const auto yStart{ bandHeight * band };
+        const auto yStop{ std::min(yStart + bandHeight, height) };
+
+        for (auto y{ yStart }; y < yStop; y++) {
+            for (auto x{ 0 }; x < width; x++) {
+                if (srcp[stride * y + x] >= t_l) {
+                    const auto p{ static_cast<int>(labelStride * y + x) };
+                    label[p] = (srcp[stride * y + x] >= t_h) ? -2 : -1;
+
+                    if (x > 0 && srcp[stride * y + x - 1] >= t_l)
+                        unite(label, p, p - 1);
+
+                    if (y > yStart) {
+                        const auto xxStart{ std::max(x - 1, 0) };
+                        const auto xxStop{ std::min(x + 1, width - 1) };
 
-                    for (auto yy{ yyStart }; yy <= yyStop; yy++) {
                         for (auto xx{ xxStart }; xx <= xxStop; xx++) {
-                            if (!found[width * yy + xx] && srcp[stride * yy + xx] >= t_l) {
-                                srcp[stride * yy + xx] = fltMax;
-                                found[width * yy + xx] = true;
+                            if (srcp[stride * (y - 1) + xx] >= t_l)
+                                unite(label, p, static_cast<int>(labelStride * (y - 1) + xx));
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    for (auto y{ bandHeight }; y < height; y += bandHeight) {
+        for (auto x{ 0 }; x < width; x++) {
+            if (srcp[stride * y + x] >= t_l) {
+                const auto xxStart{ std::max(x - 1, 0) };
+                const auto xxStop{ std::min(x + 1, width - 1) };
+
+                for (auto xx{ xxStart }; xx <= xxStop; xx++) {
+                    if (srcp[stride * (y - 1) + xx] >= t_l)
+                        unite(label, static_cast<int>(labelStride * y + x), static_cast<int>(labelStride * (y - 1) + xx));
+                }
+            }
+        }
+    }
+
+    pool->run(numBands, [&](const int band) {
+        const auto yStart{ bandHeight * band };
+        const auto yStop{ std::min(yStart + bandHeight, height) };
+
+        auto bandCount{ 0 };
+
+        for (auto y{ yStart }; y < yStop; y++) {
+            for (auto x{ 0 }; x < width; x++) {
+                if (srcp[stride * y + x] >= t_l) {
+                    auto p{ static_cast<int>(labelStride * y + x) };
+                    while (label[p] >= 0)
+                        p = label[p];
+
+                    if (label[p] == -2) {
+                        dstp[dstStride * y + x] = edge;
+                        bandCount++;
+                    }
+                }
+            }
+        }
+
+        count += bandCount;
+    });
+
+    return count;
+}
+
+static inline void fillRow(const uint64_t* weak, uint64_t* VS_RESTRICT row, const int words) noexcept {
+    uint64_t carry{};
+    for (auto i{ 0 }; i < words; i++) {
+        const auto sum{ weak[i] + row[i] };
+        const auto total{ sum + carry };
+        carry = (sum < weak[i]) | (total < sum);
+        row[i] |= weak[i] & (total ^ weak[i]);
+    }
+
+    uint64_t incoming{};
+    for (auto i{ words - 1 }; i >= 0; i--) {
+        auto reach{ row[i] | (incoming & weak[i]) };
+        auto run{ weak[i] };
+        for (auto shift{ 1 }; shift < 64; shift *= 2) {
+            reach |= run & (reach >> shift);
+            run &= run >> shift;
+        }
+        incoming = reach << 63;
+        row[i] = reach;
+    }
+}
+
+// Bit-parallel variant of hysteresis. Pixels >= t_l and >= t_h are packed into rows of 64-bit words, and the strong rows are grown into the weak
+// ones by alternating top-down and bottom-up sweeps until nothing changes. Each row is filled completely along its runs of weak pixels with a
+// ripple-carry add to the right and a segmented shift to the left, so a sweep costs only a few word operations per 64 pixels.
+template<typename pixel_t>
+static int hysteresisBitmask(const float* srcp, pixel_t* VS_RESTRICT dstp, uint64_t* VS_RESTRICT bits, const int width, const int height,
+                              const ptrdiff_t stride, const ptrdiff_t dstStride, const float t_h, const float t_l, const int peak) noexcept {
+    const auto edge{ edgeValue<pixel_t>(peak) };
+    const auto words{ (width + 63) / 64 };
+    auto weak{ bits };
+    auto strong{ bits + words * height };
+    auto temp{ strong + words * height };
+    auto anyStrong{ false };
+
+    for (auto y{ 0 }; y < height; y++) {
+        for (auto i{ 0 }; i < words; i++) {
+            uint64_t weakBits{}, strongBits{};
+
+            for (auto x{ i * 64 }; x < std::min(i * 64 + 64, width); x++) {
+                weakBits |= static_cast<uint64_t>(srcp[stride * y + x] >= t_l) << (x & 63);
+                strongBits |= static_cast<uint64_t>(srcp[stride * y + x] >= t_h) << (x & 63);
+            }
+
+            weak[words * y + i] = weakBits;
+            strong[words * y + i] = strongBits;
+            anyStrong |= strongBits != 0;
+        }
+
+        fillRow(weak + words * y, strong + words * y, words);
+    }
+
+    if (!anyStrong)
+        return 0;
+
+    for (auto changed{ true }, down{ true }; changed; down = !down) {
+        changed = false;
+
+        for (auto n{ 0 }; n < height; n++) {
+            const auto y{ down ? n : height - 1 - n };
+            auto above{ y > 0 ? strong + words * (y - 1) : nullptr };
+            auto below{ y < height - 1 ? strong + words * (y + 1) : nullptr };
+            auto grown{ false };
+
+            for (auto i{ 0 }; i < words; i++) {
+                uint64_t neighbors{};
+
+                for (auto r : { above, below }) {
+                    if (r)
+                        neighbors |= r[i] | (r[i] << 1) | (r[i] >> 1) | (i > 0 ? r[i - 1] >> 63 : 0) | (i < words - 1 ? r[i + 1] << 63 : 0);
+                }
+
+                temp[i] = strong[words * y + i] | (weak[words * y + i] & neighbors);
+                grown |= temp[i] != strong[words * y + i];
+            }
+
+            if (grown) {
+                fillRow(weak + words * y, temp, words);
+                std::copy_n(temp, words, strong + words * y);
+                changed = true;
+            }
+        }
+    }
+
+    auto count{ 0 };
+
+    for (auto y{ 0 }; y < height; y++) {
+        for (auto i{ 0 }; i < words; i++) {
+            const auto strongBits{ strong[words * y + i] };
+
+            if (strongBits) {
+                for (auto x{ i * 64 }; x < std::min(i * 64 + 64, width); x++) {
+                    if ((strongBits >> (x & 63)) & 1) {
+                        dstp[dstStride * y + x] = edge;
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+// Dilates the binary mask in place by a square, diamond or circle of the given radius and returns the number of edge pixels afterwards.
+// All three shapes only get narrower away from their center row, so the edge pixel of a column that covers the most of a row is the one
+// nearest to it vertically. Those vertical distances, saturated at radius + 1, are found for the whole plane by a top-down and a bottom-up
+// sweep into dist. Every row is then the union of the spans its columns cover, built by recording the farthest end of the spans starting at
+// each x in ends and sweeping once along the row, so the cost per pixel doesn't depend on the radius.
+template<typename pixel_t>
+static int dilate(pixel_t* VS_RESTRICT dstp, uint8_t* VS_RESTRICT dist, int* VS_RESTRICT ends, const int width, const int height,
+                  const ptrdiff_t dstStride, const int radius, const int shape, const int peak) noexcept {
+    const auto saturated{ static_cast<uint8_t>(radius + 1) };
+    const auto edge{ edgeValue<pixel_t>(peak) };
+
+    int halfWidth[maxExpand + 1];
+    for (auto dy{ 0 }; dy <= radius; dy++) {
+        if (shape == 0)
+            halfWidth[dy] = radius;
+        else if (shape == 1)
+            halfWidth[dy] = radius - dy;
+        else
+            halfWidth[dy] = static_cast<int>(std::sqrt(radius * radius - dy * dy));
+    }
+
+    for (auto y{ 0 }; y < height; y++) {
+        auto srcp{ dstp + dstStride * y };
+        auto row{ dist + static_cast<ptrdiff_t>(width) * y };
+
+        for (auto x{ 0 }; x < width; x++)
+            row[x] = (srcp[x] != pixel_t{}) ? 0 : saturated;
+
+        if (y) {
+            auto above{ row - width };
+            for (auto x{ 0 }; x < width; x++)
+                row[x] = std::min(row[x], static_cast<uint8_t>(std::min(above[x] + 1, static_cast<int>(saturated))));
+        }
+    }
+
+    for (auto y{ height - 2 }; y >= 0; y--) {
+        auto row{ dist + static_cast<ptrdiff_t>(width) * y };
+        auto below{ row + width };
+
+        for (auto x{ 0 }; x < width; x++)
+            row[x] = std::min(row[x], static_cast<uint8_t>(std::min(below[x] + 1, static_cast<int>(saturated))));
+    }
+
+    auto count{ 0 };
+
+    for (auto y{ 0 }; y < height; y++) {
+        auto row{ dist + static_cast<ptrdiff_t>(width) * y };
+        auto dst{ dstp + dstStride * y };
+
+        std::fill_n(ends, width, -1);
+        for (auto x{ 0 }; x < width; x++) {
+            if (row[x] <= radius) {
+                const auto start{ std::max(x - halfWidth[row[x]], 0) };
+                ends[start] = std::max(ends[start], x + halfWidth[row[x]]);
+            }
+        }
+
+        auto end{ -1 };
+        for (auto x{ 0 }; x < width; x++) {
+            end = std::max(end, ends[x]);
+            dst[x] = (x <= end) ? edge : pixel_t{};
+            count += (x <= end);
+        }
+    }
+
+    return count;
+}
+
+// Exact Euclidean distance transform of the edge mask in dstp, written back over it. The distance to the nearest edge pixel in the same
+// column is found by a top-down and a bottom-up sweep into grid, after which every row takes the lower envelope of the parabolas
+// (x - q)^2 + grid[q]^2 as in Felzenszwalb and Huttenlocher's algorithm, so the whole plane is done in linear time. Distances are given in
+// pixels and saturated at maxDistance when it is not 0. A plane without edge pixels is infinitely far from any, so it is filled with the
+// saturated value, which is infinity for float formats when maxDistance is 0.
+template<typename pixel_t>
+static void distanceTransform(pixel_t* VS_RESTRICT dstp, int* VS_RESTRICT grid, int* VS_RESTRICT parabolas, double* VS_RESTRICT boundaries,
+                              const int width, const int height, const ptrdiff_t gridStride, const ptrdiff_t dstStride, const float maxDistance,
+                              const int peak) noexcept {
+    const auto far{ width + height };
+
+    auto store{ [&](pixel_t& dst, float distance) noexcept {
+        if (maxDistance > 0.0f)
+            distance = std::min(distance, maxDistance);
+
+        if constexpr (std::is_integral_v<pixel_t>)
+            dst = static_cast<pixel_t>(std::min(distance, static_cast<float>(peak)) + 0.5f);
+        else if constexpr (std::is_same_v<pixel_t, half>)
+            dst = floatToHalf(distance);
+        else
+            dst = distance;
+    } };
+
+    auto found{ false };
+
+    for (auto y{ 0 }; y < height; y++) {
+        auto srcp{ dstp + dstStride * y };
+        auto row{ grid + gridStride * y };
+
+        for (auto x{ 0 }; x < width; x++) {
+            const auto edge{ srcp[x] != pixel_t{} };
+            row[x] = edge ? 0 : far;
+            found |= edge;
+        }
+
+        if (y) {
+            auto above{ row - gridStride };
+            for (auto x{ 0 }; x < width; x++)
+                row[x] = std::min(row[x], above[x] + 1);
+        }
+    }
+
+    if (!found) {
+        for (auto y{ 0 }; y < height; y++) {
+            auto dst{ dstp + dstStride * y };
+            for (auto x{ 0 }; x < width; x++)
+                store(dst[x], std::numeric_limits<float>::infinity());
+        }
+        return;
+    }
+
+    for (auto y{ height - 2 }; y >= 0; y--) {
+        auto row{ grid + gridStride * y };
+        auto below{ row + gridStride };
+
+        for (auto x{ 0 }; x < width; x++)
+            row[x] = std::min(row[x], below[x] + 1);
+    }
+
+    for (auto y{ 0 }; y < height; y++) {
+        auto row{ grid + gridStride * y };
+        auto dst{ dstp + dstStride * y };
+        auto parabola{ [&](const int q) noexcept { return static_cast<int64_t>(row[q]) * row[q] + static_cast<int64_t>(q) * q; } };
+
+        auto k{ 0 };
+        parabolas[0] = 0;
+        boundaries[0] = -std::numeric_limits<double>::infinity();
+        boundaries[1] = std::numeric_limits<double>::infinity();
+
+        for (auto q{ 1 }; q < width; q++) {
+            double s;
+            while ((s = static_cast<double>(parabola(q) - parabola(parabolas[k])) / (2 * (q - parabolas[k]))) <= boundaries[k])
+                k--;
+
+            k++;
+            parabolas[k] = q;
+            boundaries[k] = s;
+            boundaries[k + 1] = std::numeric_limits<double>::infinity();
+        }
+
+        k = 0;
+        for (auto x{ 0 }; x < width; x++) {
+            while (boundaries[k + 1] < x)
+                k++;
+
+            const auto dx{ static_cast<int64_t>(x - parabolas[k]) };
+            store(dst[x], static_cast<float>(std::sqrt(static_cast<double>(dx * dx + static_cast<int64_t>(row[parabolas[k]]) * row[parabolas[k]]))));
+        }
+    }
+}
+
+// Runs the hysteresis chosen by hmode and threads on the output of nonMaximumSuppression once per threshold pair, with the masks stacked
+// vertically in dstp, dilates them if requested and returns the total number of edge pixels. t_h and t_l are used when there is a single pair,
+// otherwise they are the lowest of all pairs that nonMaximumSuppression collected the seeds for. Only the flood fill changes srcp, so the
+// output of nonMaximumSuppression is restored from a copy before every further pair.
+template<typename pixel_t>
+static int applyHysteresis(float* VS_RESTRICT srcp, pixel_t* VS_RESTRICT dstp, int* VS_RESTRICT direction, TCannyScratch* VS_RESTRICT scratch,
+                           const TCannyData* const VS_RESTRICT d, const int width, const int height, const ptrdiff_t stride, const ptrdiff_t bgStride,
+                           const ptrdiff_t dstStride, const float t_h, const float t_l) {
+    const auto pairs{ static_cast<int>(d->thresholdPairs.size()) };
+    const auto floodFill{ d->hmode == 0 && d->threads == 1 };
+    const auto planeSize{ bgStride * (height - 1) + width };
+    auto count{ 0 };
+
+    for (auto k{ 0 }; k < pairs; k++) {
+        const auto pairT_h{ (pairs > 1) ? d->thresholdPairs[k].first : t_h };
+        const auto pairT_l{ (pairs > 1) ? d->thresholdPairs[k].second : t_l };
+        auto pairDstp{ dstp + dstStride * height * k };
+        auto pairCount{ 0 };
+
+        if (floodFill && pairs > 1) {
+            if (k == 0)
+                std::copy_n(srcp, planeSize, scratch->suppressed.data());
+            else
+                std::copy_n(scratch->suppressed.data(), planeSize, srcp);
+        }
+
+        if (d->hmode == 1) {
+            pairCount = hysteresisBitmask(srcp, pairDstp, reinterpret_cast<uint64_t*>(direction), width, height, bgStride, dstStride, pairT_h, pairT_l,
+                                          d->peak);
+        } else if (d->threads > 1) {
+            pairCount = hysteresisLabel(srcp, pairDstp, direction, width, height, bgStride, dstStride, stride, pairT_h, pairT_l, d->peak, d->pool.get(),
+                                        d->threads);
+        } else {
+            auto seeds{ &scratch->seeds };
+
+            if (pairT_h > t_h) {
+                scratch->pairSeeds.clear();
+                std::copy_if(seeds->begin(), seeds->end(), std::back_inserter(scratch->pairSeeds),
+                             [&](const uint32_t pos) noexcept { return srcp[pos] >= pairT_h; });
+                seeds = &scratch->pairSeeds;
+            }
+
+            pairCount = hysteresis(srcp, pairDstp, *seeds, scratch->spans, scratch->borders, width, height, bgStride, dstStride, pairT_l, d->peak);
+        }
+
+        if (d->expand && pairCount)
+            pairCount = dilate(pairDstp, scratch->expandDist.data(), scratch->expandEnds.data(), width, height, dstStride, d->expand, d->eshape, d->peak);
+
+        count += pairCount;
+    }
+
+    return count;
+}
+
+static inline void putVarint(std::vector<uint8_t>& out, unsigned value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+// Encodes the edges of a binary mask row by row. Every run of edge pixels is stored as the distance of its start from the end of the previous
+// run in the row plus 1, followed by its length minus 1, both as LEB128 varints. A 0 ends the row.
+template<typename pixel_t>
+static void encodeRuns(const pixel_t* dstp, const int width, const int height, const ptrdiff_t dstStride, std::vector<uint8_t>& runs) {
+    runs.clear();
+
+    for (auto y{ 0 }; y < height; y++) {
+        auto end{ 0 };
+
+        for (auto x{ 0 }; x < width; x++) {
+            if (dstp[x] != pixel_t{}) {
+                auto start{ x };
+                while (x + 1 < width && dstp[x + 1] != pixel_t{})
+                    x++;
+
+                putVarint(runs, start - end + 1);
+                putVarint(runs, x - start);
+                end = x + 1;
+            }
+        }
+
+        runs.push_back(0);
+        dstp += dstStride;
+    }
+}
+
+// Processes every plane of a frame. Kernels provides the blurPlane, detectEdge, nonMaximumSuppression and discretizeGM of one instruction
+// set, everything else is shared by all of them.
+template<typename Kernels, typename pixel_t, typename out_t>
+static void filterPlanes(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch,
+                         const VSAPI* vsapi) {
+    for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
+        if (d->process[plane]) {
+            const auto width{ vsapi->getFrameWidth(src, plane) };
+            const auto height{ vsapi->getFrameHeight(src, plane) };
+            const auto stride{ vsapi->getStride(src, plane) / d->vi->format.bytesPerSample };
+            const auto bgStride{ stride + d->radiusAlign * 2 };
+            const auto dstStride{ vsapi->getStride(dst, d->combine ? 0 : plane) / d->outVi.format.bytesPerSample };
+            auto srcp{ reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane)) };
+            auto dstp{ reinterpret_cast<out_t*>((d->combine && plane) ? scratch->planeOut[plane - 1].get() : vsapi->getWritePtr(dst, plane)) };
 
-                                coordinates.emplace_back(std::make_pair(xx, yy));
+            auto gradient{ scratch->gradient.get() + bgStride + d->radiusAlign };
+            auto direction{ scratch->direction.get() };
+            auto activity{ scratch->activity.get() };
+            auto contrast{ (d->tmode == 3) ? scratch->contrast.get() : nullptr };
+            const auto tilesX{ (width + activityTileSize - 1) / activityTileSize };
+            const auto numTiles{ tilesX * ((height + activityTileSize - 1) / activityTileSize) };
+            const auto numScales{ static_cast<int>(d->sigmaScales.size()) };
+            auto edgeCount{ 0 };
+
+            Kernels::blurPlane(srcp, reinterpret_cast<const pixel_t**>(scratch->rows.get()), gradient, scratch->blur.get() + d->radiusAlign, width,
+                               height, stride, bgStride, d->radiusH[plane], d->radiusV[plane], d->weightsH[plane].get(), d->weightsV[plane].get());
+
+            for (auto k{ 0 }; k < numScales; k++) {
+                auto blur{ ((k % 2) ? scratch->blur2.get() : scratch->blur.get()) + d->radiusAlign };
+                auto scaleDstp{ dstp };
+                if (k)
+                    scaleDstp = (d->smode == 1) ? dstp + dstStride * height * k : reinterpret_cast<out_t*>(scratch->scaleOut.get());
+
+                // The next scale is blurred from this one before the edge detection overwrites it.
+                if (k + 1 < numScales) {
+                    const auto& step{ d->scaleSteps[k] };
+                    Kernels::blurPlane(static_cast<const float*>(blur), reinterpret_cast<const float**>(scratch->rows.get()), gradient,
+                                       (((k + 1) % 2) ? scratch->blur2.get() : scratch->blur.get()) + d->radiusAlign, width, height, bgStride,
+                                       bgStride, step.radiusH[plane], step.radiusV[plane], step.weightsH[plane].get(), step.weightsV[plane].get());
+                }
+
+                if (d->mode != -1) {
+                    const auto gradientScale{ (d->smode == 2) ? d->scale * d->sigmaScales[k] / d->sigmaScales[0] : d->scale };
+                    Kernels::detectEdge(blur, gradient, direction, activity, contrast, (d->stats && k == 0) ? &scratch->stats[plane] : nullptr,
+                                        scaleDstp, width, height, stride, bgStride, dstStride, tilesX, (d->mode == 4) ? 0 : d->mode, d->op,
+                                        gradientScale, (d->mode == 3) ? d->rampScale : d->outScale, d->rampOffset, d->gamma, d->peak);
+
+                    if (d->mode == 0 || d->mode == 4) {
+                        std::fill_n(scaleDstp, dstStride * height * d->thresholdPairs.size(), static_cast<out_t>(0));
+                        const auto autoThreshold{ d->tmode == 1 || d->tmode == 2 };
+
+                        if (contrast)
+                            adaptiveScales(contrast, activity, width, height, tilesX);
+
+                        const auto gradMax{ *std::max_element(activity, activity + numTiles) };
+                        auto t_h{ d->t_h };
+                        auto t_l{ d->t_l };
+                        auto picked{ false };
+
+                        if (autoThreshold ? gradMax > 0.0f : gradMax >= t_h) {
+                            if (autoThreshold) {
+                                const auto binScale{ histogramBins / gradMax };
+                                Kernels::nonMaximumSuppression(direction, gradient, blur, activity, scratch->seeds, scratch->histogram.data(),
+                                                               nullptr, nullptr, width, height, stride, bgStride, tilesX, d->radiusAlign, 0.0f, 0.0f,
+                                                               binScale);
+                                picked = autoThresholds(scratch->histogram, scratch->seeds, blur, binScale, d->tmode, d->tpct, d->t_l / d->t_h, t_h, t_l);
+                            } else {
+                                Kernels::nonMaximumSuppression(direction, gradient, blur, activity, scratch->seeds, nullptr, contrast,
+                                                               contrast ? scratch->scaleRow.get() : nullptr, width, height, stride, bgStride, tilesX,
+                                                               d->radiusAlign, t_h, t_l, 0.0f);
                             }
+
+                            edgeCount += applyHysteresis(blur, scaleDstp, direction, scratch, d, width, height, stride, bgStride, dstStride, t_h, t_l);
                         }
+
+                        // Nothing was picked on a plane without any ridge left, which is reported like an unprocessed plane.
+                        if (autoThreshold) {
+                            scratch->thresholds[plane][0] = picked ? t_h : 0.0f;
+                            scratch->thresholds[plane][1] = picked ? t_l : 0.0f;
+                        }
+
+                        if (d->mode == 4)
+                            distanceTransform(scaleDstp, direction, scratch->parabolas.get(), scratch->boundaries.get(), width, height, stride, dstStride,
+                                              d->dmax, d->peak);
+                    } else if (d->mode == 2) {
+                        Kernels::template nonMaximumSuppression<false>(direction, gradient, blur, activity, scratch->seeds, nullptr, nullptr, nullptr,
+                                                                       width, height, stride, bgStride, tilesX, d->radiusAlign, d->t_h, d->t_l, 0.0f);
                     }
                 }
+
+                if (d->mode == 2)
+                    Kernels::template discretizeGM<out_t>(blur, scaleDstp, width, height, bgStride, dstStride, d->peak, d->outScale);
+                else if (d->mode == -1)
+                    Kernels::template discretizeGM<out_t, false>(blur, scaleDstp, width, height, bgStride, dstStride, d->peak, d->outScale);
+
+                if (k && d->smode != 1)
+                    maxPlane(static_cast<const out_t*>(scaleDstp), dstp, width, height, dstStride, 0, 0);
+            }
+
+            if (d->mode == 0 || d->mode == 4) {
+                if (numScales > 1 && d->smode != 1)
+                    edgeCount = countEdges(dstp, width, height, dstStride);
+
+                if (d->stats)
+                    scratch->stats[plane].edgeCount = edgeCount;
+
+                if (d->runs)
+                    encodeRuns(dstp, width, height * (d->outVi.height / d->vi->height), dstStride, scratch->runs[plane]);
             }
         }
     }
 }
+
@@ -1,12 +1,15 @@
 #ifdef TCANNY_X86
 #include "TCanny.h"
 
+static inline Vec16f load_16h(const half* p) noexcept {
+    return _mm512_cvtph_ps(Vec16us().load_a(p));
+}
+
 template<typename pixel_t>
-static void gaussianBlur(const pixel_t* __srcp, float* temp, float* dstp, const int width, const int height,
+static void gaussianBlur(const pixel_t* __srcp, const pixel_t** _srcp, float* temp, float* dstp, const int width, const int height,
                          const ptrdiff_t srcStride, const ptrdiff_t dstStride, const int radiusH, const int radiusV,
                          const float* weightsH, const float* weightsV) noexcept {
     auto diameter{ radiusV * 2 + 1 };
-    auto _srcp{ std::make_unique<const pixel_t* []>(diameter) };
 
     _srcp[radiusV] = __srcp;
     for (auto i{ 1 }; i <= radiusV; i++)
@@ -25,6 +28,9 @@ static void gaussianBlur(const pixel_t* __srcp, float* temp, float* dstp, const
                 } else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
                     auto srcp{ to_float(Vec16i().load_16us(_srcp[v] + x)) };
                     sum = mul_add(srcp, weightsV[v], sum);
+                } else if constexpr (std::is_same_v<pixel_t, half>) {
+                    auto srcp{ load_16h(_srcp[v] + x) };
+                    sum = mul_add(srcp, weightsV[v], sum);
                 } else {
                     AUTO_PTR srcp{ Vec16f().load_a(_srcp[v] + x) };
                     sum = mul_add(srcp, weightsV[v], sum);
@@ -68,6 +74,8 @@ static void gaussianBlurH(const pixel_t* _srcp, float* temp, float* dstp, const
                 to_float(Vec16i().load_16uc(_srcp + x)).store_a(temp + x);
             else if constexpr (std::is_same_v<pixel_t, uint16_t>)
                 to_float(Vec16i().load_16us(_srcp + x)).store_a(temp + x);
+            else if constexpr (std::is_same_v<pixel_t, half>)
+                load_16h(_srcp + x).store_a(temp + x);
             else
                 Vec16f().load_a(_srcp + x).store_a(temp + x);
         }
@@ -94,10 +102,9 @@ static void gaussianBlurH(const pixel_t* _srcp, float* temp, float* dstp, const
 }
 
 template<typename pixel_t>
-static void gaussianBlurV(const pixel_t* __srcp, float* dstp, const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
-                          const int radius, const float* weights) noexcept {
+static void gaussianBlurV(const pixel_t* __srcp, const pixel_t** _srcp, float* dstp, const int width, const int height, const ptrdiff_t srcStride,
+                          const ptrdiff_t dstStride, const int radius, const float* weights) noexcept {
     auto diameter{ radius * 2 + 1 };
-    auto _srcp{ std::make_unique<const pixel_t* []>(diameter) };
 
     _srcp[radius] = __srcp;
     for (auto i{ 1 }; i <= radius; i++)
@@ -114,6 +121,9 @@ static void gaussianBlurV(const pixel_t* __srcp, float* dstp, const int width, c
                 } else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
                     auto srcp{ to_float(Vec16i().load_16us(_srcp[v] + x)) };
                     sum = mul_add(srcp, weights[v], sum);
+                } else if constexpr (std::is_same_v<pixel_t, half>) {
+                    auto srcp{ load_16h(_srcp[v] + x) };
+                    sum = mul_add(srcp, weights[v], sum);
                 } else {
                     AUTO_PTR srcp{ Vec16f().load_a(_srcp[v] + x) };
                     sum = mul_add(srcp, weights[v], sum);
@@ -138,6 +148,8 @@ static void copyPlane(const pixel_t* srcp, float* dstp, const int width, const i
                 to_float(Vec16i().load_16uc(srcp + x)).store_nt(dstp + x);
             else if constexpr (std::is_same_v<pixel_t, uint16_t>)
                 to_float(Vec16i().load_16us(srcp + x)).store_nt(dstp + x);
+            else if constexpr (std::is_same_v<pixel_t, half>)
+                load_16h(srcp + x).store_nt(dstp + x);
             else
                 Vec16f().load_a(srcp + x).store_nt(dstp + x);
         }
@@ -147,14 +159,57 @@ static void copyPlane(const pixel_t* srcp, float* dstp, const int width, const i
     }
 }
 
-static void detectEdge(float* blur, float* gradient, int* direction, const int width, const int height, const ptrdiff_t stride, const ptrdiff_t bgStride,
-                       const int mode, const int op, const float scale) noexcept {
+template<typename pixel_t>
+static void blurPlane(const pixel_t* srcp, const pixel_t** rows, float* temp, float* dstp, const int width, const int height, const ptrdiff_t srcStride,
+                      const ptrdiff_t dstStride, const int radiusH, const int radiusV, const float* weightsH, const float* weightsV) noexcept {
+    if (radiusH && radiusV)
+        gaussianBlur(srcp, rows, temp, dstp, width, height, srcStride, dstStride, radiusH, radiusV, weightsH, weightsV);
+    else if (radiusH)
+        gaussianBlurH(srcp, temp, dstp, width, height, srcStride, dstStride, radiusH, weightsH);
+    else if (radiusV)
+        gaussianBlurV(srcp, rows, dstp, width, height, srcStride, dstStride, radiusV, weightsV);
+    else
+        copyPlane(srcp, dstp, width, height, srcStride, dstStride);
+}
+
+template<typename pixel_t, bool clampFP = true>
+static inline void discretize(const Vec16f srcp, pixel_t* dstp, const int peak) noexcept {
+    if constexpr (std::is_same_v<pixel_t, uint8_t>) {
+        auto result{ compress_saturated_s2u(compress_saturated(truncatei(srcp + 0.5f), zero_si512()), zero_si512()).get_low().get_low() };
+        result.store_nt(dstp);
+    } else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
+        auto result{ compress_saturated_s2u(truncatei(srcp + 0.5f), zero_si512()).get_low() };
+        min(result, peak).store_nt(dstp);
+    } else if constexpr (std::is_same_v<pixel_t, half>) {
+        Vec16us(_mm512_cvtps_ph(clampFP ? min(max(srcp, 0.0f), 1.0f) : srcp, _MM_FROUND_TO_NEAREST_INT)).store_nt(dstp);
+    } else if constexpr (clampFP) {
+        min(max(srcp, 0.0f), 1.0f).store_nt(dstp);
+    } else {
+        srcp.store_nt(dstp);
+    }
+}
+
+template<typename pixel_t>
+static void detectEdge(float* blur, float* gradient, int* direction, float* activity, float* contrast, TCannyStats* stats, pixel_t* dstp,
+                       const int width, const int height, const ptrdiff_t stride, const ptrdiff_t bgStride, const ptrdiff_t dstStride, const int tilesX,
+                       const int mode, const int op, const float scale, const float outScale, const float offset, const float gamma,
+                       const int peak) noexcept {
     auto cur{ blur };
     auto next{ blur + bgStride };
     auto next2{ blur + bgStride * 2 };
     auto prev{ next };
     auto prev2{ next2 };
 
+    double gradSum{}, orientation[4]{};
+    auto gradMax{ Vec16f(0.0f) };
+    auto tileSum{ Vec16f(0.0f) };
+    const auto rampPeak{ std::is_integral_v<pixel_t> ? static_cast<float>(peak) : 1.0f };
+
+    if (mode == 0)
+        std::fill_n(activity, tilesX * ((height + activityTileSize - 1) / activityTileSize), 0.0f);
+    if (contrast)
+        std::fill_n(contrast, tilesX * ((height + activityTileSize - 1) / activityTileSize), 0.0f);
+
     cur[-1] = cur[1];
     cur[width] = cur[width - 2];
     if (op == FDOG) {
@@ -175,8 +230,10 @@ static void detectEdge(float* blur, float* gradient, int* direction, const int w
             next2[width + 1] = next2[width - 3];
         }
 
+        Vec16f rowSum(0.0f), rowOrientation[]{ 0.0f, 0.0f, 0.0f, 0.0f };
+
         for (auto x{ 0 }; x < width; x += Vec16f().size()) {
-            Vec16f gx, gy;
+            Vec16f gx, gy, magnitude;
 
             if (op != FDOG) {
                 AUTO_PTR c1{ Vec16f().load(prev + x - 1) };
@@ -219,7 +276,7 @@ static void detectEdge(float* blur, float* gradient, int* direction, const int w
                     auto g7{ mul_sub(5.0f, c3 + c6 + c9, 3.0f * (c1 + c2 + c4 + c7 + c8)) };
                     auto g8{ mul_sub(5.0f, c2 + c3 + c6, 3.0f * (c1 + c4 + c7 + c8 + c9)) };
                     auto g{ max(max(max(abs(g1), abs(g2)), max(abs(g3), abs(g4))), max(max(abs(g5), abs(g6)), max(abs(g7), abs(g8)))) };
-                    (g * scale).store_nt(gradient + x);
+                    magnitude = g * scale;
                     break;
                 }
             } else {
@@ -257,18 +314,61 @@ static void detectEdge(float* blur, float* gradient, int* direction, const int w
             if (op != KIRSCH) {
                 gx *= scale;
                 gy *= scale;
-                sqrt(mul_add(gx, gx, gy * gy)).store_nt(gradient + x);
+                magnitude = sqrt(mul_add(gx, gx, gy * gy));
             }
 
-            if (mode == 0) {
+            auto valid{ magnitude };
+            if ((stats || mode == 0) && width - x < Vec16f().size())
+                valid.cutoff(width - x);
+
+            if (stats) {
+                rowSum += valid;
+                gradMax = max(gradMax, valid);
+            }
+
+            if (mode == 1 || mode == 3) {
+                auto value{ magnitude * outScale + offset };
+                if (mode == 3 && gamma != 1.0f)
+                    value = pow(min(max(value / rampPeak, 0.0f), 1.0f), gamma) * rampPeak;
+                discretize(value, dstp + x, peak);
+            } else {
+                magnitude.store_nt(gradient + x);
+
+                if (mode == 0) {
+                    const auto tile{ (y / activityTileSize) * tilesX + x / activityTileSize };
+                    activity[tile] = std::max(activity[tile], horizontal_max1(valid));
+
+                    if (contrast) {
+                        tileSum += valid;
+                        if ((x + Vec16f().size()) % activityTileSize == 0 || x + Vec16f().size() >= width) {
+                            contrast[tile] += horizontal_add(tileSum);
+                            tileSum = 0.0f;
+                        }
+                    }
+                }
+            }
+
+            if (mode == 0 || mode == 2) {
                 auto dr{ atan2(gy, gx) };
                 dr = if_add(dr < 0.0f, dr, M_PIF);
 
                 auto bin{ truncatei(mul_add(dr, 4.0f * M_1_PIF, 0.5f)) };
-                select(bin >= 4, zero_si512(), bin).store_nt(direction + x);
+                bin = select(bin >= 4, zero_si512(), bin);
+                bin.store_nt(direction + x);
+
+                if (stats) {
+                    for (auto i{ 0 }; i < 4; i++)
+                        rowOrientation[i] += select(Vec16fb(bin == i), valid, 0.0f);
+                }
             }
         }
 
+        if (stats) {
+            gradSum += horizontal_add(rowSum);
+            for (auto i{ 0 }; i < 4; i++)
+                orientation[i] += horizontal_add(rowOrientation[i]);
+        }
+
         prev2 = prev;
         prev = cur;
         cur = next;
@@ -280,11 +380,25 @@ static void detectEdge(float* blur, float* gradient, int* direction, const int w
         }
         gradient += bgStride;
         direction += stride;
+        dstp += dstStride;
+    }
+
+    if (stats) {
+        stats->gradSum = gradSum;
+        stats->gradMax = horizontal_max1(gradMax);
+        std::copy_n(orientation, 4, stats->orientation);
     }
 }
 
-static void nonMaximumSuppression(const int* _direction, float* _gradient, float* blur, const int width, const int height,
-                                  const ptrdiff_t stride, const ptrdiff_t bgStride, const int radiusAlign) noexcept {
+template<bool thresholded = true>
+static void nonMaximumSuppression(const int* _direction, float* _gradient, float* blur, const float* activity, std::vector<uint32_t>& seeds,
+                                  int* histogram, const float* contrast, float* scaleRow, const int width, const int height, const ptrdiff_t stride,
+                                  const ptrdiff_t bgStride, const int tilesX, const int radiusAlign, const float t_h, const float t_l,
+                                  const float binScale) {
+    seeds.clear();
+    if (histogram)
+        std::fill_n(histogram, histogramBins, 0);
+
     _gradient[-1] = _gradient[1];
     _gradient[-1 + bgStride * (height - 1)] = _gradient[1 + bgStride * (height - 1)];
     _gradient[width] = _gradient[width - 2];
@@ -293,7 +407,17 @@ static void nonMaximumSuppression(const int* _direction, float* _gradient, float
     std::copy_n(_gradient - radiusAlign + bgStride * (height - 2), width + radiusAlign * 2, _gradient - radiusAlign + bgStride * height);
 
     for (auto y{ 0 }; y < height; y++) {
+        if (scaleRow)
+            interpolateScales(contrast, scaleRow, y, width, height, tilesX);
+
         for (auto x{ 0 }; x < width; x += Vec16f().size()) {
+            if constexpr (thresholded) {
+                if (activity[(y / activityTileSize) * tilesX + x / activityTileSize] < t_l) {
+                    Vec16f(fltLowest).store_nt(blur + x);
+                    continue;
+                }
+            }
+
             AUTO_PTR direction{ Vec16i().load_a(_direction + x) };
 
             auto mask{ Vec16fb(direction == 0) };
@@ -313,7 +437,26 @@ static void nonMaximumSuppression(const int* _direction, float* _gradient, float
             result |= gradient & mask;
 
             gradient = Vec16f().load_a(_gradient + x);
-            select(gradient >= result, gradient, fltLowest).store_nt(blur + x);
+            result = select(gradient >= result, scaleRow ? gradient * Vec16f().load(scaleRow + x) : gradient, thresholded ? fltLowest : 0.0f);
+            result.store_nt(blur + x);
+
+            if constexpr (thresholded) {
+                if (histogram) {
+                    for (auto ridge{ static_cast<uint32_t>(to_bits(result > 0.0f)) }; ridge; ridge &= ridge - 1) {
+                        const auto i{ static_cast<int>(bit_scan_forward(ridge)) };
+                        if (x + i < width) {
+                            seeds.push_back(static_cast<uint32_t>(bgStride * y + x + i));
+                            histogram[std::min(static_cast<int>(result[i] * binScale), histogramBins - 1)]++;
+                        }
+                    }
+                } else {
+                    for (auto strong{ static_cast<uint32_t>(to_bits(result >= t_h)) }; strong; strong &= strong - 1) {
+                        const auto i{ static_cast<int>(bit_scan_forward(strong)) };
+                        if (x + i < width)
+                            seeds.push_back(static_cast<uint32_t>(bgStride * y + x + i));
+                    }
+                }
+            }
         }
 
         _direction += stride;
@@ -322,102 +465,43 @@ static void nonMaximumSuppression(const int* _direction, float* _gradient, float
     }
 }
 
-template<typename pixel_t>
-static void binarizeCE(const float* _srcp, pixel_t* dstp, const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
-                       const int peak) noexcept {
-    for (auto y{ 0 }; y < height; y++) {
-        for (auto x{ 0 }; x < width; x += Vec16f().size()) {
-            AUTO_PTR srcp{ Vec16f().load_a(_srcp + x) };
-
-            if constexpr (std::is_same_v<pixel_t, uint8_t>) {
-                auto mask{ Vec16cb(srcp == fltMax) };
-                select(mask, Vec16uc(255), zero_si128()).store_nt(dstp + x);
-            } else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
-                auto mask{ Vec16sb(srcp == fltMax) };
-                select(mask, Vec16us(peak), zero_si256()).store_nt(dstp + x);
-            } else {
-                auto mask{ srcp == fltMax };
-                select(mask, Vec16f(1.0f), Vec16f(0.0f)).store_nt(dstp + x);
-            }
-        }
-
-        _srcp += srcStride;
-        dstp += dstStride;
-    }
-}
-
 template<typename pixel_t, bool clampFP = true>
 static void discretizeGM(const float* _srcp, pixel_t* dstp, const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
-                         const int peak) noexcept {
+                         const int peak, const float outScale) noexcept {
     for (auto y{ 0 }; y < height; y++) {
-        for (auto x{ 0 }; x < width; x += Vec16f().size()) {
-            AUTO_PTR srcp{ Vec16f().load_a(_srcp + x) };
-
-            if constexpr (std::is_same_v<pixel_t, uint8_t>) {
-                auto result{ compress_saturated_s2u(compress_saturated(truncatei(srcp + 0.5f), zero_si512()), zero_si512()).get_low().get_low() };
-                result.store_nt(dstp + x);
-            } else if constexpr (std::is_same_v<pixel_t, uint16_t>) {
-                auto result{ compress_saturated_s2u(truncatei(srcp + 0.5f), zero_si512()).get_low() };
-                min(result, peak).store_nt(dstp + x);
-            } else if constexpr (clampFP) {
-                min(max(srcp, 0.0f), 1.0f).store_nt(dstp + x);
-            } else {
-                srcp.store_nt(dstp + x);
-            }
-        }
+        for (auto x{ 0 }; x < width; x += Vec16f().size())
+            discretize<pixel_t, clampFP>(Vec16f().load_a(_srcp + x) * outScale, dstp + x, peak);
 
         _srcp += srcStride;
         dstp += dstStride;
     }
 }
 
-template<typename pixel_t>
-void filter_avx512(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept {
-    for (auto plane{ 0 }; plane < d->vi->format.numPlanes; plane++) {
-        if (d->process[plane]) {
-            const auto width{ vsapi->getFrameWidth(src, plane) };
-            const auto height{ vsapi->getFrameHeight(src, plane) };
-            const auto stride{ vsapi->getStride(src, plane) / d->vi->format.bytesPerSample };
-            const auto bgStride{ stride + d->radiusAlign * 2 };
-            auto srcp{ reinterpret_cast<const pixel_t*>(vsapi->getReadPtr(src, plane)) };
-            auto dstp{ reinterpret_cast<pixel_t*>(vsapi->getWritePtr(dst, plane)) };
-
-            const auto threadId{ std::this_thread::get_id() };
-            auto blur{ d->blur.at(threadId).get() + d->radiusAlign };
-            auto gradient{ d->gradient.at(threadId).get() + bgStride + d->radiusAlign };
-            auto direction{ d->direction.at(threadId).get() };
-            auto found{ d->found.at(threadId).get() };
-
-            if (d->radiusH[plane] && d->radiusV[plane])
-                gaussianBlur(srcp, gradient, blur, width, height, stride, bgStride, d->radiusH[plane], d->radiusV[plane],
-                             d->weightsH[plane].get(), d->weightsV[plane].get());
-            else if (d->radiusH[plane])
-                gaussianBlurH(srcp, gradient, blur, width, height, stride, bgStride, d->radiusH[plane], d->weightsH[plane].get());
-            else if (d->radiusV[plane])
-                gaussianBlurV(srcp, blur, width, height, stride, bgStride, d->radiusV[plane], d->weightsV[plane].get());
-            else
-                copyPlane(srcp, blur, width, height, stride, bgStride);
+// The kernels of this file for filterPlanes.
+struct KernelsAVX512 final {
+    template<typename... Args>
+    static void blurPlane(Args&&... args) noexcept { ::blurPlane(std::forward<Args>(args)...); }
 
-            if (d->mode != -1) {
-                detectEdge(blur, gradient, direction, width, height, stride, bgStride, d->mode, d->op, d->scale);
+    template<typename... Args>
+    static void detectEdge(Args&&... args) noexcept { ::detectEdge(std::forward<Args>(args)...); }
 
-                if (d->mode == 0) {
-                    nonMaximumSuppression(direction, gradient, blur, width, height, stride, bgStride, d->radiusAlign);
-                    hysteresis(blur, found, width, height, bgStride, d->t_h, d->t_l);
-                }
-            }
+    template<bool thresholded = true, typename... Args>
+    static void nonMaximumSuppression(Args&&... args) { ::nonMaximumSuppression<thresholded>(std::forward<Args>(args)...); }
 
-            if (d->mode == 0)
-                binarizeCE(blur, dstp, width, height, bgStride, stride, d->peak);
-            else if (d->mode == 1)
-                discretizeGM(gradient, dstp, width, height, bgStride, stride, d->peak);
-            else
-                discretizeGM<pixel_t, false>(blur, dstp, width, height, bgStride, stride, d->peak);
-        }
-    }
+    template<typename pixel_t, bool clampFP = true, typename... Args>
+    static void discretizeGM(Args&&... args) noexcept { ::discretizeGM<pixel_t, clampFP>(std::forward<Args>(args)...); }
+};
+
+template<typename pixel_t, typename out_t>
+void filter_avx512(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi) {
+    filterPlanes<KernelsAVX512, pixel_t, out_t>(src, dst, d, scratch, vsapi);
 }
 
-template void filter_avx512<uint8_t>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept;
-template void filter_avx512<uint16_t>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept;
-template void filter_avx512<float>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept;
+template void filter_avx512<uint8_t, uint8_t>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
+template void filter_avx512<uint16_t, uint16_t>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
+template void filter_avx512<float, float>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
+template void filter_avx512<uint16_t, uint8_t>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
+template void filter_avx512<float, uint8_t>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
+template void filter_avx512<half, half>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
+template void filter_avx512<half, uint8_t>(const VSFrame* src, VSFrame* dst, const TCannyData* const VS_RESTRICT d, TCannyScratch* const VS_RESTRICT scratch, const VSAPI* vsapi);
 #endif